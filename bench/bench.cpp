@@ -0,0 +1,585 @@
+// samtag benchmarks on synthetic data. Not part of the default build:
+//
+//   $ make bench                   # default data set
+//   $ bench/samtag-bench --reads 10000000 --tagged 0.5 --aux-tags 4 --cardinality 100000
+//
+// Each benchmark reports the number of items it processed (reads, TSV
+// lines or records), the wall time and the throughput.
+//
+// With --check the tagging paths are instead checked against each other and
+// against htslib, on the generated data and the test/ data (`make check`).
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <iterator>
+#include <tuple>
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <filesystem>
+#include <variant>
+#include <type_traits>
+#include <array>
+#include <charconv>
+#include <numeric>
+#include <chrono>
+#include <random>
+#include <unordered_set>
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+
+#include "samtag.hpp"
+#include "engine.hpp"
+#include "commands.hpp"
+
+using namespace samtag::detail;
+
+#ifndef SAMTAG_TEST_DATA
+#define SAMTAG_TEST_DATA "test"
+#endif
+
+struct BenchOptions
+{
+    std::size_t num_reads = 1'000'000, name_length = 40, num_aux_tags = 2, cardinality = 1'000;
+    double tagged_fraction = 0.1;
+    int threads = 4;
+    std::optional<std::string> filter;
+    fs::path directory = fs::temp_directory_path() / "samtag-bench";
+    bool keep = false, check = false;
+};
+
+void print_bench_help()
+{
+    std::cout << "Usage: samtag-bench [options]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -n, --reads INT       Number of reads to generate [1000000]" << std::endl;
+    std::cout << "  --name-length INT     Length of read names (>= 16) [40]" << std::endl;
+    std::cout << "  --tagged FLOAT        Fraction of reads in the read list [0.1]" << std::endl;
+    std::cout << "  --aux-tags INT        Number of aux tags per read (<= 10) [2]" << std::endl;
+    std::cout << "  --cardinality INT     Number of distinct values per tag [1000]" << std::endl;
+    std::cout << "  -@, --threads INT     Number of threads for threaded benchmarks [4]" << std::endl;
+    std::cout << "  -f, --filter STR      Only run benchmarks whose name contains STR" << std::endl;
+    std::cout << "  -d, --directory DIR   Directory for generated data [$TMPDIR/samtag-bench]" << std::endl;
+    std::cout << "  --keep                Keep generated data" << std::endl;
+    std::cout << "  --check               Check tagging paths agree instead of benchmarking them" << std::endl;
+    std::cout << "  -h, --help            Print this help message";
+}
+
+auto parse_bench_args(const int argc, char** argv)
+{
+    BenchOptions result {};
+    std::vector<std::string_view> args(argv + 1, argv + argc);
+    std::optional<std::string_view> option {};
+    const auto to_size = [&] (const std::string_view arg) {
+        std::size_t value {};
+        const auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), value);
+        if (ec != std::errc {} || ptr != arg.data() + arg.size()) {
+            std::cerr << "ERROR: invalid value '" << arg << "' for " << *option << std::endl;
+            exit(1);
+        }
+        return value;
+    };
+    for (const auto& arg : args) {
+        if (!option) {
+            if (arg == "-h" || arg == "--help") {
+                print_bench_help();
+                exit(0);
+            } else if (arg == "--keep") {
+                result.keep = true;
+            } else if (arg == "--check") {
+                result.check = true;
+            } else if (arg.starts_with('-')) {
+                option = arg;
+            } else {
+                std::cerr << "ERROR: unexpected argument '" << arg << "'" << std::endl;
+                exit(1);
+            }
+            continue;
+        }
+        if (option == "-n" || option == "--reads") {
+            result.num_reads = to_size(arg);
+        } else if (option == "--name-length") {
+            result.name_length = to_size(arg);
+        } else if (option == "--tagged") {
+            result.tagged_fraction = std::stod(std::string {arg});
+        } else if (option == "--aux-tags") {
+            result.num_aux_tags = to_size(arg);
+        } else if (option == "--cardinality") {
+            result.cardinality = to_size(arg);
+        } else if (option == "-@" || option == "--threads") {
+            result.threads = static_cast<int>(to_size(arg));
+        } else if (option == "-f" || option == "--filter") {
+            result.filter = std::string {arg};
+        } else if (option == "-d" || option == "--directory") {
+            result.directory = arg;
+        } else {
+            std::cerr << "ERROR: unknown option " << *option << std::endl;
+            exit(1);
+        }
+        option = std::nullopt;
+    }
+    if (option) {
+        std::cerr << "ERROR: missing value for " << *option << std::endl;
+        exit(1);
+    }
+    if (result.num_reads == 0 || result.name_length < 16 || result.name_length > 254 || result.num_aux_tags > 10
+     || result.cardinality == 0 || result.tagged_fraction < 0 || result.tagged_fraction > 1 || result.threads < 1) {
+        std::cerr << "ERROR: option out of range (see --help)" << std::endl;
+        exit(1);
+    }
+    return result;
+}
+
+//
+// synthetic data
+//
+
+struct BenchData
+{
+    fs::path bam_path, tsv_path;
+    std::vector<std::string> names;
+    std::size_t num_listed;
+};
+
+// Names share an instrument style prefix, as real read names do, and end in
+// the read number so they are unique.
+std::string make_read_name(const std::size_t i, const std::size_t length, std::mt19937_64& rng)
+{
+    constexpr std::string_view alphabet {"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"};
+    std::string result {"A00123:8:H7KJ3DSXX:1:"};
+    result.resize(std::min(result.size(), length - 12));
+    std::uniform_int_distribution<std::size_t> letter {0, alphabet.size() - 1};
+    while (result.size() < length - 12) result.push_back(alphabet[letter(rng)]);
+    std::array<char, 12> number;
+    std::snprintf(number.data(), number.size(), "%011zx", i);
+    result.append(number.data(), 11);
+    result.push_back(':');
+    return result;
+}
+
+std::string tag_value(const std::size_t k)
+{
+    return "V" + std::to_string(k);
+}
+
+Tag::Name aux_tag_name(const std::size_t i) noexcept
+{
+    return {'X', static_cast<char>('0' + i)};
+}
+
+BenchData generate_data(const BenchOptions& options)
+{
+    BenchData result {};
+    fs::create_directories(options.directory);
+    result.bam_path = options.directory / "reads.bam";
+    result.tsv_path = options.directory / "reads.tsv";
+    std::mt19937_64 rng {42};
+    std::uniform_int_distribution<std::size_t> value {0, options.cardinality - 1};
+    std::bernoulli_distribution listed {options.tagged_fraction};
+    result.names.reserve(options.num_reads);
+    for (std::size_t i {0}; i < options.num_reads; ++i) {
+        result.names.push_back(make_read_name(i, options.name_length, rng));
+    }
+    // Coordinate sorted reads on a single contig
+    const std::size_t read_length {100}, spacing {10};
+    const auto contig_length = options.num_reads * spacing + read_length;
+    const auto header_text = "@HD\tVN:1.6\tSO:coordinate\n@SQ\tSN:chr1\tLN:" + std::to_string(contig_length) + "\n";
+    std::unique_ptr<bam_hdr_t, HtsHeaderDeleter> header {sam_hdr_parse(header_text.size(), header_text.c_str()), HtsHeaderDeleter {}};
+    std::unique_ptr<htsFile, HtsFileDeleter> bam {sam_open(result.bam_path.c_str(), "wb"), HtsFileDeleter {}};
+    if (!header || !bam || sam_hdr_write(bam.get(), header.get()) < 0) {
+        std::cerr << "ERROR: could not write " << result.bam_path << std::endl;
+        exit(1);
+    }
+    std::unique_ptr<bam1_t, HtsBam1Deleter> rec {bam_init1(), HtsBam1Deleter {}};
+    const std::uint32_t cigar {static_cast<std::uint32_t>(read_length) << BAM_CIGAR_SHIFT | BAM_CMATCH};
+    std::string seq(read_length, 'A'), qual(read_length, 30);
+    std::uniform_int_distribution<std::size_t> base {0, 3};
+    for (std::size_t i {0}; i < options.num_reads; ++i) {
+        std::generate(std::begin(seq), std::end(seq), [&] () { return "ACGT"[base(rng)]; });
+        const auto& name = result.names[i];
+        if (bam_set1(rec.get(), name.size(), name.c_str(), 0, 0, static_cast<hts_pos_t>(i * spacing), 60, 1, &cigar,
+                     -1, -1, 0, seq.size(), seq.c_str(), qual.c_str(), options.num_aux_tags * 8) < 0) {
+            std::cerr << "ERROR: could not create read " << name << std::endl;
+            exit(1);
+        }
+        for (std::size_t t {0}; t < options.num_aux_tags; ++t) {
+            const auto aux_value = tag_value(value(rng));
+            bam_aux_append(rec.get(), aux_tag_name(t).data(), 'Z', static_cast<int>(aux_value.size() + 1),
+                           reinterpret_cast<const std::uint8_t*>(aux_value.c_str()));
+        }
+        if (sam_write1(bam.get(), header.get(), rec.get()) < 0) {
+            std::cerr << "ERROR: could not write " << result.bam_path << std::endl;
+            exit(1);
+        }
+    }
+    // The list is in random order, as lists produced by other tools usually are
+    std::vector<std::size_t> order(options.num_reads);
+    std::iota(std::begin(order), std::end(order), std::size_t {0});
+    std::shuffle(std::begin(order), std::end(order), rng);
+    std::ofstream tsv {result.tsv_path};
+    result.num_listed = 0;
+    for (const auto i : order) {
+        if (!listed(rng)) continue;
+        tsv << result.names[i] << "\tZA:" << tag_value(value(rng)) << '\n';
+        ++result.num_listed;
+    }
+    if (!tsv.flush()) {
+        std::cerr << "ERROR: could not write " << result.tsv_path << std::endl;
+        exit(1);
+    }
+    return result;
+}
+
+auto read_records(const fs::path& bam_path)
+{
+    std::vector<std::unique_ptr<bam1_t, HtsBam1Deleter>> result {};
+    const auto [bam, header] = open_bam(bam_path);
+    while (true) {
+        std::unique_ptr<bam1_t, HtsBam1Deleter> rec {bam_init1(), HtsBam1Deleter {}};
+        if (sam_read1(bam.get(), header.get(), rec.get()) < 0) break;
+        result.push_back(std::move(rec));
+    }
+    return result;
+}
+
+//
+// benchmarks
+//
+
+class BenchRunner
+{
+public:
+    explicit BenchRunner(std::optional<std::string> filter) : filter_ {std::move(filter)}
+    {
+        std::cout << "benchmark\titems\tseconds\titems/s" << std::endl;
+    }
+
+    bool selected(const std::string_view name) const noexcept
+    {
+        return !filter_ || name.find(*filter_) != std::string_view::npos;
+    }
+
+    // Runs f, which returns the number of items processed, if name is selected
+    template <typename F>
+    void run(const std::string_view name, F f) const
+    {
+        if (!selected(name)) return;
+        const auto start = std::chrono::steady_clock::now();
+        const std::size_t items {f()};
+        const std::chrono::duration<double> seconds {std::chrono::steady_clock::now() - start};
+        std::cout << name << '\t' << items << '\t' << seconds.count() << '\t'
+                  << static_cast<std::size_t>(items / std::max(seconds.count(), 1e-9)) << std::endl;
+    }
+
+private:
+    std::optional<std::string> filter_;
+};
+
+// Options for `samtag tag -o output bam_path tsv_path`
+TagOptions make_tag_options(const fs::path& bam_path, const fs::path& tsv_path, const fs::path& output)
+{
+    TagOptions result {};
+    result.src_bam_paths = {bam_path};
+    result.qname_tsv_path = tsv_path;
+    result.output = output;
+    return result;
+}
+
+// Options for `samtag stats --tag tag --split -o output bam_path`
+StatsOptions make_stats_options(const fs::path& bam_path, const std::string_view tag, const fs::path& output)
+{
+    StatsOptions result {};
+    result.bam_path = bam_path;
+    result.tags.push_back(parse_search_tag(tag));
+    result.split = true;
+    result.output = output;
+    return result;
+}
+
+void run_benchmarks(const BenchOptions& options, const BenchData& data)
+{
+    const BenchRunner bench {options.filter};
+    const auto num_reads = data.names.size();
+    WorkerPool workers {static_cast<std::size_t>(options.threads)};
+    bench.run("load_reads", [&] () {
+        return load_reads(data.tsv_path).names.size();
+    });
+    bench.run("load_reads/threads", [&] () {
+        return load_reads(data.tsv_path, std::nullopt, false, &workers).names.size();
+    });
+    if (bench.selected("lookup")) {
+        const auto reads = load_reads(data.tsv_path, std::nullopt, true, &workers);
+        const auto check_found = [&] (const std::size_t found) {
+            if (found != data.num_listed) {
+                std::cerr << "ERROR: found " << found << " of " << data.num_listed << " listed reads" << std::endl;
+                exit(1);
+            }
+        };
+        bench.run("lookup", [&] () {
+            std::size_t found {0};
+            for (const auto& name : data.names) found += reads.names.find(name, hash_read_name(name)) != nullptr;
+            check_found(found);
+            return num_reads;
+        });
+        bench.run("lookup/prefilter", [&] () {
+            std::size_t found {0};
+            for (const auto& name : data.names) {
+                const auto hash = hash_read_name(name);
+                found += reads.filter->may_contain(hash) && reads.names.find(name, hash) != nullptr;
+            }
+            check_found(found);
+            return num_reads;
+        });
+    }
+    if (bench.selected("aux") || bench.selected("add_read")) {
+        auto records = read_records(data.bam_path);
+        AuxEditor editor {};
+        bench.run("aux/append", [&] () {
+            for (std::size_t i {0}; i < records.size(); ++i) {
+                editor.add(Tag {{'Z', 'A'}, i % 2 == 0 ? Tag::Value {std::string_view {"value"}} : Tag::Value {static_cast<long>(i % 200)}});
+                editor.apply(records[i].get());
+            }
+            return records.size();
+        });
+        bench.run("aux/replace", [&] () {
+            for (std::size_t i {0}; i < records.size(); ++i) {
+                editor.add(Tag {{'Z', 'A'}, i % 2 == 0 ? Tag::Value {std::string_view {"other"}} : Tag::Value {static_cast<long>(i % 100)}});
+                if (options.num_aux_tags > 0) editor.add(Tag {aux_tag_name(0), std::string_view {"V0"}});
+                editor.apply(records[i].get());
+            }
+            return records.size();
+        });
+        if (options.num_aux_tags > 0) {
+            const auto tag = std::string {aux_tag_name(0).data(), 2};
+            const std::vector<std::pair<std::string, std::vector<std::string>>> stats_benchmarks {
+                {"add_read", {tag}},
+                {"add_read/split", {tag, "--split"}},
+                {"add_read/prefix", {tag + ":^V1", "--split"}},
+                {"add_read/regex", {tag + ":V1.*5", "--split"}},
+                {"add_read/top", {tag, "--split", "--top", "10"}},
+                {"add_read/distinct", {tag, "--split", "--distinct"}}};
+            for (const auto& [name, args] : stats_benchmarks) {
+                StatsOptions stats_options {};
+                stats_options.tags.push_back(parse_search_tag(args.front()));
+                stats_options.split = std::find(std::cbegin(args), std::cend(args), "--split") != std::cend(args);
+                stats_options.distinct = std::find(std::cbegin(args), std::cend(args), "--distinct") != std::cend(args);
+                if (std::find(std::cbegin(args), std::cend(args), "--top") != std::cend(args)) stats_options.top = 10;
+                bench.run(name, [&] () {
+                    auto stats = init_stats(stats_options);
+                    for (const auto& rec : records) add_read(*rec, stats);
+                    return records.size();
+                });
+            }
+        }
+    }
+    const auto output = options.directory / "tagged.bam", stats_output = options.directory / "stats.tsv";
+    bench.run("tag", [&] () {
+        run_tag(make_tag_options(data.bam_path, data.tsv_path, output));
+        return num_reads;
+    });
+    bench.run("tag/threads", [&] () {
+        auto tag_options = make_tag_options(data.bam_path, data.tsv_path, output);
+        tag_options.threads = options.threads;
+        run_tag(tag_options);
+        return num_reads;
+    });
+    bench.run("tag/stats", [&] () {
+        auto tag_options = make_tag_options(data.bam_path, data.tsv_path, output);
+        tag_options.threads = options.threads;
+        tag_options.stats_tags.push_back(parse_search_tag("ZA"));
+        tag_options.split_stats = true;
+        tag_options.stats_output = stats_output;
+        run_tag(tag_options);
+        return num_reads;
+    });
+    if (options.num_aux_tags > 0) {
+        const auto tag = std::string {aux_tag_name(0).data(), 2};
+        bench.run("stats", [&] () {
+            run_stats(make_stats_options(data.bam_path, tag, stats_output));
+            return num_reads;
+        });
+        bench.run("stats/threads", [&] () {
+            auto stats_options = make_stats_options(data.bam_path, tag, stats_output);
+            stats_options.threads = options.threads;
+            run_stats(stats_options);
+            return num_reads;
+        });
+    }
+}
+
+//
+// self checks
+//
+
+bool same_record(const bam1_t& lhs, const bam1_t& rhs) noexcept
+{
+    const auto fields = [] (const bam1_core_t& core) {
+        return std::tie(core.pos, core.tid, core.bin, core.qual, core.l_extranul, core.flag, core.l_qname,
+                        core.n_cigar, core.l_qseq, core.mtid, core.mpos, core.isize);
+    };
+    return fields(lhs.core) == fields(rhs.core) && lhs.l_data == rhs.l_data
+        && std::equal(lhs.data, lhs.data + lhs.l_data, rhs.data);
+}
+
+// AuxEditor must write what calling bam_aux_update_* for each edit would,
+// for replaced, retyped and new tags, and leave tags of another kind
+// unchanged as they do. The second round edits the tags added by the first.
+std::size_t check_aux_edits(const std::vector<std::unique_ptr<bam1_t, HtsBam1Deleter>>& records)
+{
+    constexpr std::array<long, 7> ints {-1, 5, 200, -300, 40000, -70000, 3'000'000'000};
+    constexpr std::array<std::string_view, 3> strings {"", "x", "a longer value than most"};
+    AuxEditor editor {};
+    std::unique_ptr<bam1_t, HtsBam1Deleter> edited {bam_init1(), HtsBam1Deleter {}}, expected {bam_init1(), HtsBam1Deleter {}};
+    std::vector<Tag> edits {};
+    for (std::size_t i {0}; i < records.size(); ++i) {
+        if (!bam_copy1(edited.get(), records[i].get()) || !bam_copy1(expected.get(), records[i].get())) {
+            std::cerr << "ERROR: could not copy read " << bam_get_qname(records[i].get()) << std::endl;
+            exit(1);
+        }
+        for (std::size_t round {0}; round < 2; ++round) {
+            const auto k = i + round;
+            edits.clear();
+            for_each_aux(*edited, [&] (const std::uint8_t* aux) {
+                const Tag::Name id {static_cast<char>(aux[0]), static_cast<char>(aux[1])};
+                switch (aux[2]) {
+                case 'Z': edits.push_back({id, k % 3 == 0 ? Tag::Value {ints[k % ints.size()]} : Tag::Value {strings[k % strings.size()]}}); break;
+                case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
+                    edits.push_back({id, k % 5 == 0 ? Tag::Value {0.5f} : Tag::Value {ints[k % ints.size()]}}); break;
+                case 'f': case 'd': edits.push_back({id, Tag::Value {0.25f * static_cast<float>(k)}}); break;
+                default: break;
+                }
+            });
+            edits.push_back({{'Y', 'Z'}, strings[(k + 1) % strings.size()]});
+            edits.push_back({{'Y', 'I'}, ints[(k + 2) % ints.size()]});
+            edits.push_back({{'Y', 'F'}, 1.5f});
+            // A second edit of a tag, as --tag makes over a listed value
+            edits.push_back({{'Y', 'I'}, k % 2 == 0 ? Tag::Value {ints[k % ints.size()]} : Tag::Value {strings[2]}});
+            for (const auto& tag : edits) {
+                editor.add(tag);
+                std::visit([&] (auto&& value) {
+                    using T = std::remove_cv_t<std::decay_t<decltype(value)>>;
+                    if constexpr (std::is_same_v<T, long>) {
+                        bam_aux_update_int(expected.get(), tag.id.data(), value);
+                    } else if constexpr (std::is_same_v<T, float>) {
+                        bam_aux_update_float(expected.get(), tag.id.data(), value);
+                    } else if (!value.empty()) {
+                        bam_aux_update_str(expected.get(), tag.id.data(), static_cast<int>(value.size() + 1), value.data());
+                    }
+                }, tag.value);
+            }
+            editor.apply(edited.get());
+            if (!same_record(*edited, *expected)) {
+                std::cerr << "ERROR: AuxEditor and bam_aux_update_* differ on read " << bam_get_qname(records[i].get()) << std::endl;
+                exit(1);
+            }
+        }
+    }
+    return records.size();
+}
+
+// Regions covering some listed reads (at most max_regions), so --passthrough
+// both copies and rewrites blocks
+void write_check_regions(const fs::path& bam_path, const fs::path& tsv_path, const fs::path& bed_path, const std::size_t max_regions)
+{
+    std::unordered_set<std::string> listed {};
+    std::ifstream tsv {tsv_path};
+    for (std::string line {}; std::getline(tsv, line);) listed.insert(line.substr(0, line.find('\t')));
+    const auto stride = std::max(listed.size() / max_regions, std::size_t {1});
+    const auto [bam, header] = open_bam(bam_path);
+    std::unique_ptr<bam1_t, HtsBam1Deleter> rec {bam_init1(), HtsBam1Deleter {}};
+    std::ofstream bed {bed_path};
+    for (std::size_t n {0}; sam_read1(bam.get(), header.get(), rec.get()) >= 0;) {
+        if (rec->core.tid < 0 || !listed.contains(bam_get_qname(rec.get())) || n++ % stride != 0) continue;
+        bed << sam_hdr_tid2name(header.get(), rec->core.tid) << '\t' << rec->core.pos << '\t' << bam_endpos(rec.get()) << '\n';
+    }
+    if (!bed.flush()) {
+        std::cerr << "ERROR: could not write " << bed_path << std::endl;
+        exit(1);
+    }
+}
+
+// Exits unless both files have the same header and records
+std::size_t check_same_output(const fs::path& expected_path, const fs::path& actual_path)
+{
+    const auto header_text = [] (const fs::path& path) {
+        const auto [bam, header] = open_bam(path);
+        return std::string {sam_hdr_str(header.get())};
+    };
+    const auto expected = read_records(expected_path), actual = read_records(actual_path);
+    const auto same = header_text(expected_path) == header_text(actual_path)
+        && std::equal(std::cbegin(expected), std::cend(expected), std::cbegin(actual), std::cend(actual),
+                      [] (const auto& lhs, const auto& rhs) { return same_record(*lhs, *rhs); });
+    if (!same) {
+        std::cerr << "ERROR: " << actual_path << " differs from " << expected_path << std::endl;
+        exit(1);
+    }
+    return expected.size();
+}
+
+// Sharded output must be record for record that of the plain path, and so
+// must passthrough output with the same target regions
+std::size_t check_tag_paths(const fs::path& bam_path, const fs::path& tsv_path, const std::optional<Tag>& default_tag,
+                            const fs::path& directory)
+{
+    const auto bed_path = directory / "check.bed";
+    write_check_regions(bam_path, tsv_path, bed_path, 20);
+    const auto tag = [&] (const std::string& output, auto&& set_options) {
+        auto options = make_tag_options(bam_path, tsv_path, directory / output);
+        options.tag = default_tag;
+        set_options(options);
+        run_tag(options);
+        return directory / output;
+    };
+    const auto plain = tag("plain.bam", [] (TagOptions&) {});
+    const auto sharded = tag("sharded.bam", [] (TagOptions& options) { options.shards = 4; });
+    const auto regions = tag("regions.bam", [&] (TagOptions& options) { options.bed_path = bed_path; });
+    const auto passthrough = tag("passthrough.bam", [&] (TagOptions& options) {
+        options.bed_path = bed_path;
+        options.passthrough = true;
+    });
+    return check_same_output(plain, sharded) + check_same_output(regions, passthrough);
+}
+
+void run_checks(const BenchOptions& options, const BenchData& data)
+{
+    const BenchRunner bench {options.filter};
+    const fs::path test_data {SAMTAG_TEST_DATA};
+    if (sam_index_build(data.bam_path.c_str(), 0) < 0) {
+        std::cerr << "ERROR: could not index " << data.bam_path << std::endl;
+        exit(1);
+    }
+    bench.run("check/aux", [&] () {
+        return check_aux_edits(read_records(data.bam_path)) + check_aux_edits(read_records(test_data / "test.bam"));
+    });
+    bench.run("check/tag", [&] () {
+        return check_tag_paths(data.bam_path, data.tsv_path, std::nullopt, options.directory)
+             + check_tag_paths(test_data / "test.bam", test_data / "reads1.tsv", get_tag("ZA:BAR"), options.directory)
+             + check_tag_paths(test_data / "test.bam", test_data / "reads2.tsv", get_tag("ZA"), options.directory);
+    });
+}
+
+int main(int argc, char** argv)
+{
+    const auto options = parse_bench_args(argc, argv);
+    try {
+        const auto data = generate_data(options);
+        std::clog << "Generated " << data.names.size() << " reads (" << data.num_listed << " listed) in "
+                  << options.directory << std::endl;
+        if (options.check) {
+            run_checks(options, data);
+        } else {
+            run_benchmarks(options, data);
+        }
+    } catch (const samtag::Error& error) {
+        std::clog << error.what() << std::endl;
+        exit(1);
+    }
+    if (!options.keep) fs::remove_all(options.directory);
+}
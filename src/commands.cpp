@@ -0,0 +1,2131 @@
+// Copyright (c) 2022 Daniel Cooke
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#include "commands.hpp"
+
+#include <fstream>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <tuple>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <filesystem>
+#include <variant>
+#include <type_traits>
+#include <array>
+#include <functional>
+#include <cassert>
+#include <cstdlib>
+#include <span>
+#include <cstring>
+#include <numeric>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <atomic>
+#include <limits>
+#include <chrono>
+#include <exception>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+#include <htslib/kstring.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+#include <htslib/cram.h>
+
+namespace samtag::detail {
+
+// Runs f on a thread of its own. An error it throws is kept in error, for
+// the thread joining it to rethrow, rather than terminating.
+template <typename F>
+std::thread start_thread(F&& f, std::exception_ptr& error)
+{
+    return std::thread {[f = std::forward<F>(f), &error] () mutable {
+        try {
+            f();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }};
+}
+
+// Joins threads started by start_thread and rethrows the first error kept
+void join_threads(std::vector<std::thread>& threads, const std::vector<std::exception_ptr>& errors)
+{
+    for (auto& thread : threads) thread.join();
+    const auto error = std::find_if(std::cbegin(errors), std::cend(errors), [] (const auto& error) { return error != nullptr; });
+    if (error != std::cend(errors)) std::rethrow_exception(*error);
+}
+
+auto make_thread_pool(const int threads)
+{
+    std::unique_ptr<hts_tpool, HtsThreadPoolDeleter> result {};
+    if (threads > 1) {
+        result.reset(hts_tpool_init(threads));
+        if (!result) throw_error("Failed to create thread pool");
+    }
+    return result;
+}
+
+void attach_thread_pool(htsFile* file, hts_tpool* pool)
+{
+    if (pool) {
+        htsThreadPool p {pool, 0};
+        if (hts_set_opt(file, HTS_OPT_THREAD_POOL, &p) < 0) throw_error("Failed to attach thread pool");
+    }
+}
+
+using ContigIntervals = std::pair<int, std::span<const hts_pair_pos_t>>;
+
+// sam_itr_regions takes ownership of the region list and frees it with the
+// iterator, so the list and its intervals must be allocated with malloc.
+auto query_regions(const hts_idx_t* index, bam_hdr_t* header, const std::vector<ContigIntervals>& regions)
+{
+    assert(!regions.empty());
+    auto reglist = static_cast<hts_reglist_t*>(std::calloc(regions.size(), sizeof(hts_reglist_t)));
+    for (std::size_t i {0}; i < regions.size(); ++i) {
+        const auto& [tid, intervals] = regions[i];
+        assert(!intervals.empty());
+        auto& r = reglist[i];
+        r.reg = header->target_name[tid];
+        r.tid = tid;
+        r.count = static_cast<std::uint32_t>(intervals.size());
+        r.intervals = static_cast<hts_pair_pos_t*>(std::malloc(intervals.size() * sizeof(hts_pair_pos_t)));
+        std::copy(std::cbegin(intervals), std::cend(intervals), r.intervals);
+        r.min_beg = intervals.front().beg;
+        r.max_end = intervals.back().end;
+    }
+    std::unique_ptr<hts_itr_t, HtsIteratorDeleter> result {
+        sam_itr_regions(index, header, reglist, static_cast<unsigned>(regions.size())), HtsIteratorDeleter {}};
+    if (!result) throw_error("Failed to query target regions");
+    return result;
+}
+
+auto query_regions(const hts_idx_t* index, bam_hdr_t* header, const TargetRegions& targets)
+{
+    std::vector<ContigIntervals> regions {};
+    for (int tid {0}; tid < static_cast<int>(targets.intervals.size()); ++tid) {
+        if (!targets.intervals[tid].empty()) regions.emplace_back(tid, targets.intervals[tid]);
+    }
+    return query_regions(index, header, regions);
+}
+
+//
+// tag
+//
+
+void log_tag_progress(const TagCounts& counts)
+{
+    std::clog << "Processed " << counts.reads << " reads -- marked " << counts.marked
+              << " (~" << (counts.reads > 0 ? static_cast<int>(100 * counts.marked / counts.reads) : 0) << "%)"
+              << std::endl;
+}
+
+void log_filter_stats(const TagCounts& counts)
+{
+    const auto false_positives = counts.reads - counts.filtered - counts.marked;
+    std::clog << "Prefilter rejected " << counts.filtered << " of " << counts.reads << " reads ("
+              << false_positives << " false positives)" << std::endl;
+}
+
+struct ReadBatch
+{
+    std::vector<std::unique_ptr<bam1_t, HtsBam1Deleter>> reads;
+    std::size_t size = 0, slot = 0;
+    TagCounts counts;
+    AuxEditor editor;
+};
+
+// Placeholder for tagging without stats. Otherwise Stats is TagStats, with 
+// each tagged record counted by add_read (found by ADL) in the same pass.
+struct NoStats {};
+
+template <typename Stats>
+constexpr bool has_stats_v = !std::is_same_v<Stats, NoStats>;
+
+
+void set_reference(htsFile* file, const CramReference& reference)
+{
+    if (!file->is_cram) return;
+    if (reference.shared && reference.shared->is_cram) {
+        hts_set_opt(file, CRAM_OPT_SHARED_REF, cram_get_refs(reference.shared));
+    } else if (reference.fasta && hts_set_fai_filename(file, reference.fasta->c_str()) < 0) {
+        throw_error("ERROR: failed to load reference ", *reference.fasta);
+    }
+}
+
+// Moves a standard stream through a queue of large blocks on two threads of
+// its own: one keeps draining (or filling) the real stream and the other
+// feeds a pipe of the relay, so an upstream aligner or downstream sort is not
+// stalled while records are being tagged. While the relay runs, open_stream
+// opens "-" on its pipe; the standard fds themselves are left alone.
+class StreamRelay
+{
+public:
+    enum class Stream { in, out };
+
+    StreamRelay(const Stream stream, const std::size_t block_size = 4 << 20, const std::size_t max_blocks = 8)
+    : stream_ {stream}
+    , queue_ {std::make_shared<Queue>()}
+    {
+        int fds[2], stop_fds[2];
+        if (pipe(fds) < 0) throw_error("Failed to create pipe for ", name());
+        if (pipe(stop_fds) < 0) {
+            ::close(fds[0]);
+            ::close(fds[1]);
+            throw_error("Failed to create pipe for ", name());
+        }
+#ifdef F_SETPIPE_SZ
+        fcntl(fds[0], F_SETPIPE_SZ, 1 << 20);
+#endif
+        const auto [our_end, their_end] = stream == Stream::in ? std::pair {fds[1], fds[0]} : std::pair {fds[0], fds[1]};
+        fd_ = their_end;
+        stop_fds_ = {stop_fds[0], stop_fds[1]};
+        const int std_fd {stream == Stream::in ? STDIN_FILENO : STDOUT_FILENO};
+        const auto [src, dst] = stream == Stream::in ? std::pair {std_fd, our_end} : std::pair {our_end, std_fd};
+        queue_->block_size = block_size;
+        queue_->max_blocks = max_blocks;
+        reader_ = std::thread {read_blocks, queue_, src, src != std_fd, stop_fds[0], name()};
+        writer_ = std::thread {write_blocks, queue_, dst, dst != std_fd, name()};
+        relay_fd(stream) = fd_;
+    }
+    StreamRelay(const StreamRelay&) = delete;
+    StreamRelay& operator=(const StreamRelay&) = delete;
+    ~StreamRelay() { finish(); }
+
+    // The pipe the program reads (or writes) in place of the stream, if a
+    // relay of the stream is running
+    static std::optional<int> fd(const Stream stream) noexcept
+    {
+        const int result {relay_fd(stream)};
+        return result >= 0 ? std::optional<int> {result} : std::nullopt;
+    }
+
+    // Ends the relay once everything the program wrote to it is passed on,
+    // or at once for stdin, and throws if either stream failed. Files opened
+    // on the relay must be closed first.
+    void close()
+    {
+        finish();
+        std::lock_guard lock {queue_->mutex};
+        if (!queue_->error.empty()) throw_error(queue_->error);
+    }
+
+private:
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        std::size_t size;
+    };
+    struct Queue
+    {
+        std::mutex mutex {};
+        std::condition_variable changed {};
+        std::deque<Block> full {}, free {};
+        std::size_t block_size, max_blocks, num_blocks = 0;
+        bool closed = false;
+        std::string error {}; // the first failure of either stream
+    };
+
+    Stream stream_;
+    std::shared_ptr<Queue> queue_;
+    int fd_;
+    std::array<int, 2> stop_fds_; // a pipe to wake the reader
+    std::thread reader_, writer_;
+
+    const char* name() const noexcept { return stream_ == Stream::in ? "stdin" : "stdout"; }
+
+    static std::atomic<int>& relay_fd(const Stream stream) noexcept
+    {
+        static std::array<std::atomic<int>, 2> result {-1, -1};
+        return result[stream == Stream::in ? 0 : 1];
+    }
+
+    void finish() noexcept
+    {
+        if (fd_ < 0) return;
+        relay_fd(stream_) = -1;
+        // Closing our copy of the program's end lets the output reader see the
+        // end of the stream, and stops the input writer. The rest of stdin is
+        // not needed, so its reader is woken and stopped.
+        ::close(fd_);
+        fd_ = -1;
+        if (stream_ == Stream::in) {
+            const char stop {};
+            while (::write(stop_fds_[1], &stop, 1) < 0 && errno == EINTR);
+        }
+        reader_.join();
+        writer_.join();
+        ::close(stop_fds_[0]);
+        ::close(stop_fds_[1]);
+    }
+
+    static void fail(Queue& queue, std::string error)
+    {
+        std::lock_guard lock {queue.mutex};
+        if (queue.error.empty()) queue.error = std::move(error);
+    }
+
+    static void read_blocks(const std::shared_ptr<Queue> queue, const int fd, const bool own_fd, const int stop_fd, const char* name)
+    {
+        Block block {};
+        for (bool eof {false}; !eof;) {
+            {
+                std::unique_lock lock {queue->mutex};
+                queue->changed.wait(lock, [&] () { return !queue->free.empty() || queue->num_blocks < queue->max_blocks; });
+                if (queue->free.empty()) {
+                    block.data = std::make_unique_for_overwrite<char[]>(queue->block_size);
+                    ++queue->num_blocks;
+                } else {
+                    block = std::move(queue->free.front());
+                    queue->free.pop_front();
+                }
+            }
+            // Fill the block, but hand it over early rather than leave the writer idle
+            block.size = 0;
+            while (block.size < queue->block_size) {
+                std::array<pollfd, 2> fds {{{fd, POLLIN, 0}, {stop_fd, POLLIN, 0}}};
+                if (poll(fds.data(), fds.size(), -1) < 0) {
+                    if (errno == EINTR) continue;
+                    fail(*queue, std::string {"Failed to read "} + name);
+                    eof = true;
+                    break;
+                }
+                if (fds[1].revents != 0) {
+                    eof = true;
+                    break;
+                }
+                const auto bytes = ::read(fd, block.data.get() + block.size, queue->block_size - block.size);
+                if (bytes < 0 && errno == EINTR) continue;
+                if (bytes <= 0) {
+                    if (bytes < 0) fail(*queue, std::string {"Failed to read "} + name);
+                    eof = true;
+                    break;
+                }
+                block.size += bytes;
+                std::lock_guard lock {queue->mutex};
+                if (queue->full.empty()) break;
+            }
+            std::lock_guard lock {queue->mutex};
+            if (block.size > 0) queue->full.push_back(std::move(block));
+            queue->changed.notify_all();
+        }
+        if (own_fd) ::close(fd);
+        std::lock_guard lock {queue->mutex};
+        queue->closed = true;
+        queue->changed.notify_all();
+    }
+
+    static void write_blocks(const std::shared_ptr<Queue> queue, const int fd, const bool to_pipe, const char* name)
+    {
+        // Our pipe closed before all of the input is read is not an error
+        if (to_pipe) {
+            sigset_t signals;
+            sigemptyset(&signals);
+            sigaddset(&signals, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        }
+        // After a failure blocks are still taken, and dropped, so the reader
+        // (and the program feeding it) can finish
+        bool writing {true};
+        for (;;) {
+            Block block {};
+            {
+                std::unique_lock lock {queue->mutex};
+                queue->changed.wait(lock, [&] () { return queue->closed || !queue->full.empty(); });
+                if (queue->full.empty()) break;
+                block = std::move(queue->full.front());
+                queue->full.pop_front();
+            }
+            for (std::size_t written {0}; writing && written < block.size;) {
+                const auto bytes = ::write(fd, block.data.get() + written, block.size - written);
+                if (bytes < 0 && errno == EINTR) continue;
+                if (bytes < 0) {
+                    if (!(to_pipe && errno == EPIPE)) fail(*queue, std::string {"Failed to write "} + name);
+                    writing = false;
+                    break;
+                }
+                written += bytes;
+            }
+            std::lock_guard lock {queue->mutex};
+            queue->free.push_back(std::move(block));
+            queue->changed.notify_all();
+        }
+        if (to_pipe) ::close(fd);
+    }
+};
+
+// Opens path as hopen does, but "-" on the relay of stdin or stdout while one runs
+hFILE* open_stream(const fs::path& path, const char* mode)
+{
+    if (path == "-") {
+        if (const auto relay_fd = StreamRelay::fd(mode[0] == 'r' ? StreamRelay::Stream::in : StreamRelay::Stream::out)) {
+            const auto fd = dup(*relay_fd);
+            if (fd < 0) return nullptr;
+            const auto result = hdopen(fd, mode);
+            if (!result) close(fd);
+            return result;
+        }
+    }
+    return hopen(path.c_str(), mode);
+}
+
+// Writes an output file, or stdout without a path
+htsFile* open_output_file(const std::optional<fs::path>& path, const std::string& mode)
+{
+    if (path) return sam_open(path->c_str(), mode.c_str());
+    const auto file = open_stream("-", "w");
+    if (!file) return nullptr;
+    const auto result = hts_hopen(file, "-", mode.c_str());
+    if (!result) hclose(file);
+    return result;
+}
+
+// As open_output_file, for writing BGZF blocks directly
+BGZF* open_output_bgzf(const std::optional<fs::path>& path, const std::string& mode)
+{
+    const auto file = open_stream(path.value_or("-"), "w");
+    if (!file) return nullptr;
+    const auto result = bgzf_hopen(file, mode.c_str());
+    if (!result) hclose(file);
+    return result;
+}
+
+// Local files are opened with a hint that they are read sequentially, which
+// lets the kernel read further ahead
+htsFile* open_input_file(const fs::path& path)
+{
+    std::error_code error {};
+    if (path == "-") {
+        const auto file = open_stream(path, "r");
+        if (!file) return nullptr;
+        const auto result = hts_hopen(file, "-", "r");
+        if (!result) hclose(file);
+        return result;
+    }
+    if (!fs::is_regular_file(path, error)) {
+        return sam_open(path.c_str(), "r");
+    }
+    const auto fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    const auto file = hdopen(fd, "r");
+    if (!file) {
+        close(fd);
+        return nullptr;
+    }
+    const auto result = hts_hopen(file, path.c_str(), "r");
+    if (!result) hclose(file);
+    return result;
+}
+
+std::pair<std::unique_ptr<htsFile, HtsFileDeleter>, std::unique_ptr<bam_hdr_t, HtsHeaderDeleter>>
+open_bam(const fs::path& bam_path, hts_tpool* thread_pool, const CramReference& reference)
+{
+    std::unique_ptr<htsFile, HtsFileDeleter> bam {open_input_file(bam_path), HtsFileDeleter {}};
+    if (!bam) throw_error("ERROR: failed to open ", bam_path);
+    set_reference(bam.get(), reference);
+    attach_thread_pool(bam.get(), thread_pool);
+    std::unique_ptr<bam_hdr_t, HtsHeaderDeleter> header {sam_hdr_read(bam.get()), HtsHeaderDeleter {}};
+    if (!header) throw_error("ERROR: failed to read header of ", bam_path);
+    return std::make_pair(std::move(bam), std::move(header));
+}
+
+
+// Without --output-fmt the format follows the file extension, and stdout is
+// SAM unless -u or -l ask for BAM.
+std::string get_output_mode(const std::optional<fs::path>& dst_bam_path, const OutputFormat& output_format)
+{
+    auto format = output_format.format.value_or("");
+    std::transform(std::cbegin(format), std::cend(format), std::begin(format), [] (const char c) { return std::tolower(c); });
+    if (format.empty()) {
+        const auto extension = dst_bam_path ? dst_bam_path->extension() : fs::path {};
+        if (extension == ".cram") {
+            format = "cram";
+        } else if (extension == ".sam" || (!dst_bam_path && !output_format.uncompressed && !output_format.compression_level)) {
+            format = "sam";
+        } else {
+            format = "bam";
+        }
+    }
+    if (output_format.uncompressed && format == "sam") format = "bam";
+    std::string result {"w"};
+    if (format == "bam") {
+        result += output_format.uncompressed ? "bu" : "b";
+    } else if (format == "cram") {
+        result += 'c';
+    } else if (format != "sam") {
+        throw_error("Unknown output format ", *output_format.format, " (required SAM, BAM or CRAM)");
+    }
+    if (format != "sam" && output_format.compression_level && !output_format.uncompressed) {
+        result += std::to_string(std::clamp(*output_format.compression_level, 0, 9));
+    }
+    return result;
+}
+
+// Only BGZF-compressed BAM and CRAM can be indexed as they are written
+bool is_indexable_mode(const std::string_view mode)
+{
+    return mode.find('c') != std::string_view::npos
+        || (mode.find('b') != std::string_view::npos && mode.find('u') == std::string_view::npos);
+}
+
+bool is_coordinate_sorted(const bam_hdr_t& header)
+{
+    kstring_t value {0, 0, nullptr};
+    const auto result = sam_hdr_find_tag_hd(const_cast<bam_hdr_t*>(&header), "SO", &value) == 0 
+                     && std::string_view {value.s, value.l} == "coordinate";
+    ks_free(&value);
+    return result;
+}
+
+// A .cram output is written with the version of a CRAM input and shares its
+// references. If build_index is set then the index is built as records are
+// written and must be saved with sam_idx_save before the output is closed.
+auto open_tag_output(const std::optional<fs::path>& dst_bam_path, 
+                     const bam_hdr_t& header, 
+                     hts_tpool* thread_pool = nullptr,
+                     htsFile* src_bam = nullptr,
+                     const std::optional<fs::path>& reference = std::nullopt,
+                     const bool build_index = false,
+                     const OutputFormat& output_format = {})
+{
+    const auto mode = get_output_mode(dst_bam_path, output_format);
+    const auto cram = mode.find('c') != std::string::npos;
+    std::unique_ptr<htsFile, HtsFileDeleter> dst_bam {open_output_file(dst_bam_path, mode), HtsFileDeleter {}};
+    if (!dst_bam) throw_error("Error opening output");
+    if (cram && src_bam && src_bam->is_cram) {
+        const auto version = std::to_string(cram_major_vers(src_bam->fp.cram)) + "." + std::to_string(cram_minor_vers(src_bam->fp.cram));
+        hts_set_opt(dst_bam.get(), CRAM_OPT_VERSION, version.c_str());
+    }
+    set_reference(dst_bam.get(), {reference, src_bam});
+    attach_thread_pool(dst_bam.get(), thread_pool);
+    if (sam_hdr_write(dst_bam.get(), &header) < 0) throw_error("Error writing BAM");
+    if (build_index) {
+        assert(dst_bam_path);
+        // BAI cannot index positions beyond 2^29
+        const auto long_contig = std::any_of(header.target_len, header.target_len + header.n_targets, 
+                                             [] (const auto length) { return length >= (1u << 29); });
+        if (sam_idx_init(dst_bam.get(), const_cast<bam_hdr_t*>(&header), !cram && long_contig ? 14 : 0, nullptr) < 0) {
+            throw_error("Failed to initialise index for ", *dst_bam_path);
+        }
+    }
+    return dst_bam;
+}
+
+template <typename Stats = NoStats>
+TagCounts 
+tag_reads(htsFile* src_bam,
+          bam_hdr_t* header,
+          htsFile* dst_bam,
+          const ReadList& reads,
+          const std::optional<Tag>& tag = std::nullopt,
+          const std::optional<std::uint16_t> flag = std::nullopt,
+          const TargetRegions* targets = nullptr,
+          WorkerPool* workers = nullptr,
+          const bool verbose = false,
+          const bool timed = false,
+          Stats* stats = nullptr)
+{
+    const std::size_t log_tick {10'000'000};
+    TagCounts counts {};
+    AuxEditor editor {};
+    if (!workers || workers->size() == 0) {
+        // Reads are still tagged in groups so their lookups can overlap
+        std::vector<std::unique_ptr<bam1_t, HtsBam1Deleter>> recs {};
+        recs.reserve(lookup_group_size);
+        std::generate_n(std::back_inserter(recs), lookup_group_size, [] () { 
+            return std::unique_ptr<bam1_t, HtsBam1Deleter> {bam_init1(), HtsBam1Deleter {}}; 
+        });
+        StageClock clock {timed};
+        for (bool done {false}; !done;) {
+            std::size_t size {0};
+            for (; size < recs.size(); ++size) {
+                if (sam_read1(src_bam, header, recs[size].get()) < 0) {
+                    done = true;
+                    break;
+                }
+            }
+            clock.lap(counts.times.decode);
+            const auto logged_ticks = counts.reads / log_tick;
+            tag_read_batch(std::span {recs.data(), size}, editor, reads, tag, flag, targets, counts, clock);
+            if constexpr (has_stats_v<Stats>) {
+                if (stats) std::for_each_n(std::cbegin(recs), size, [&] (const auto& rec) { add_read(*rec, *stats); });
+                clock.lap(counts.times.stats);
+            }
+            for (std::size_t j {0}; j < size; ++j) {
+                if (sam_write1(dst_bam, header, recs[j].get()) < 0) throw_error("Error writing BAM");
+            }
+            clock.lap(counts.times.encode);
+            if (verbose && counts.reads / log_tick > logged_ticks) {
+                log_tag_progress(counts);
+            }
+        }
+    } else {
+        // Reads are processed in fixed size batches: this thread fills batches,
+        // the workers tag them, and a writer thread emits them in input order.
+        // Each batch slot has its own stats, which are merged at the end.
+        const std::size_t batch_size {4096}, num_batches {4 * workers->size()};
+        BoundedQueue<std::unique_ptr<ReadBatch>> free_batches {num_batches};
+        for (std::size_t b {0}; b < num_batches; ++b) {
+            auto batch = std::make_unique<ReadBatch>();
+            batch->reads.reserve(batch_size);
+            batch->slot = b;
+            free_batches.push(std::move(batch));
+        }
+        std::vector<Stats> batch_stats {};
+        if constexpr (has_stats_v<Stats>) {
+            if (stats) {
+                batch_stats.reserve(num_batches);
+                for (std::size_t b {0}; b < num_batches; ++b) batch_stats.push_back(*stats);
+            }
+        }
+        BoundedQueue<std::future<std::unique_ptr<ReadBatch>>> tagged_batches {num_batches};
+        // After an error the writer stops returning batches, so this thread
+        // stops reading, but it still waits for every batch submitted
+        std::exception_ptr write_error {};
+        std::thread writer {[&] () {
+            while (auto tagged_batch = tagged_batches.pop()) {
+                try {
+                    auto batch = tagged_batch->get();
+                    if (write_error) continue;
+                    StageClock clock {timed};
+                    for (std::size_t j {0}; j < batch->size; ++j) {
+                        if (sam_write1(dst_bam, header, batch->reads[j].get()) < 0) throw_error("Error writing BAM");
+                    }
+                    clock.lap(batch->counts.times.encode);
+                    const auto logged_ticks = counts.reads / log_tick;
+                    counts += batch->counts;
+                    if (verbose && counts.reads / log_tick > logged_ticks) {
+                        log_tag_progress(counts);
+                    }
+                    free_batches.push(std::move(batch));
+                } catch (...) {
+                    if (!write_error) write_error = std::current_exception();
+                    free_batches.close();
+                }
+            }
+        }};
+        for (bool done {false}; !done;) {
+            auto free_batch = free_batches.pop();
+            if (!free_batch) break;
+            auto batch = std::move(*free_batch);
+            batch->size = 0;
+            batch->counts = {};
+            StageClock clock {timed};
+            while (batch->size < batch_size) {
+                if (batch->size == batch->reads.size()) {
+                    batch->reads.emplace_back(bam_init1(), HtsBam1Deleter {});
+                }
+                if (sam_read1(src_bam, header, batch->reads[batch->size].get()) < 0) {
+                    done = true;
+                    break;
+                }
+                ++batch->size;
+            }
+            clock.lap(batch->counts.times.decode);
+            tagged_batches.push(workers->submit([&, batch = std::move(batch)] () mutable {
+                StageClock clock {timed};
+                tag_read_batch(std::span {batch->reads.data(), batch->size}, batch->editor, reads, tag, flag, targets, batch->counts, clock);
+                if constexpr (has_stats_v<Stats>) {
+                    if (stats) {
+                        std::for_each_n(std::cbegin(batch->reads), batch->size, [&] (const auto& rec) { add_read(*rec, batch_stats[batch->slot]); });
+                    }
+                    clock.lap(batch->counts.times.stats);
+                }
+                return std::move(batch);
+            }));
+        }
+        tagged_batches.close();
+        writer.join();
+        if (write_error) std::rethrow_exception(write_error);
+        if constexpr (has_stats_v<Stats>) {
+            if (stats) {
+                *stats = std::move(batch_stats.front());
+                std::for_each(std::next(std::cbegin(batch_stats)), std::cend(batch_stats), [&] (const auto& other) { *stats += other; });
+            }
+        }
+    }
+    if (verbose) {
+        log_tag_progress(counts);
+        if (reads.filter) log_filter_stats(counts);
+    }
+    return counts;
+}
+
+enum class QnameOrder { natural, lexicographical };
+
+// Returns the queryname sort order declared in the header, if any.
+std::optional<QnameOrder> get_qname_order(bam_hdr_t& header)
+{
+    std::optional<QnameOrder> result {};
+    kstring_t value {0, 0, nullptr};
+    if (sam_hdr_find_tag_hd(&header, "SO", &value) == 0 && std::string_view {value.s, value.l} == "queryname") {
+        result = QnameOrder::natural;
+        if (sam_hdr_find_tag_hd(&header, "SS", &value) == 0 
+         && std::string_view {value.s, value.l}.ends_with("lexicographical")) {
+            result = QnameOrder::lexicographical;
+        }
+    }
+    ks_free(&value);
+    return result;
+}
+
+// Compares read names as samtools sort -n does: natural order compares runs
+// of digits numerically, so names that only differ in leading zeros (a01 and
+// a1) are equal, and samtools may interleave them.
+int compare_qnames(const std::string_view lhs, const std::string_view rhs, const QnameOrder order) noexcept
+{
+    if (order == QnameOrder::lexicographical) return lhs.compare(rhs);
+    const auto is_digit = [] (const char c) noexcept { return c >= '0' && c <= '9'; };
+    std::size_t i {0}, j {0};
+    while (i < lhs.size() && j < rhs.size()) {
+        if (!is_digit(lhs[i]) || !is_digit(rhs[j])) {
+            if (lhs[i] != rhs[j]) return static_cast<unsigned char>(lhs[i]) - static_cast<unsigned char>(rhs[j]);
+            ++i; ++j;
+        } else {
+            while (i < lhs.size() && lhs[i] == '0') ++i;
+            while (j < rhs.size() && rhs[j] == '0') ++j;
+            while (i < lhs.size() && j < rhs.size() && is_digit(lhs[i]) && lhs[i] == rhs[j]) ++i, ++j;
+            const int lhs_c {i < lhs.size() ? static_cast<unsigned char>(lhs[i]) : 0};
+            const int rhs_c {j < rhs.size() ? static_cast<unsigned char>(rhs[j]) : 0};
+            const auto diff = lhs_c - rhs_c;
+            while (i < lhs.size() && j < rhs.size() && is_digit(lhs[i]) && is_digit(rhs[j])) ++i, ++j;
+            const auto lhs_digits = i < lhs.size() && is_digit(lhs[i]);
+            const auto rhs_digits = j < rhs.size() && is_digit(rhs[j]);
+            if (lhs_digits) return 1;
+            if (rhs_digits) return -1;
+            if (diff) return diff;
+        }
+    }
+    if (i < lhs.size()) return 1;
+    if (j < rhs.size()) return -1;
+    return 0;
+}
+
+// Whether the names of a qname TSV are in order, so it can be streamed. A
+// scan of the mapping is cheap next to failing partway through the output.
+bool is_sorted_read_list(const fs::path& qnames_tsv_path, const QnameOrder order)
+{
+    const MappedFile file {qnames_tsv_path};
+    auto remaining = file.data();
+    std::string_view previous {};
+    while (!remaining.empty()) {
+        const auto line = pop_line(remaining);
+        if (line.empty()) continue;
+        const auto name = split_read_line(line).first;
+        if (compare_qnames(previous, name, order) > 0) return false;
+        previous = name;
+    }
+    return true;
+}
+
+// Streams a qname TSV sorted in the same order as a queryname sorted bam, so
+// only the edits of the current group of names are held in memory. A group
+// is the lines with names that are equal in the sort order, which may be in
+// any order in both the list and the bam.
+class SortedReadList
+{
+public:
+    SortedReadList(const fs::path& qnames_tsv_path, const std::optional<Tag::Name>& value_tag, const QnameOrder order)
+    : path_ {qnames_tsv_path}
+    , file_ {qnames_tsv_path}
+    , remaining_ {file_.data()}
+    , value_tag_ {value_tag}
+    , order_ {order}
+    {
+        next_ = next_line();
+        advance();
+    }
+
+    // Names must be queried in sorted order
+    const ReadEdits* find(const std::string_view name)
+    {
+        if (compare_qnames(name, last_query_, order_) < 0) {
+            throw_error("Input bam is not sorted by queryname (", name, " after ", last_query_, ")");
+        }
+        last_query_ = name;
+        while (!group_.empty() && compare_qnames(group_.front().first, name, order_) < 0) advance();
+        if (group_.empty() || compare_qnames(group_.front().first, name, order_) != 0) return nullptr;
+        const auto read = std::find_if(std::cbegin(group_), std::cend(group_), [&] (const auto& read) { return read.first == name; });
+        return read != std::cend(group_) ? &read->second : nullptr;
+    }
+    const std::vector<EditTag>& tags() const noexcept { return tags_; }
+    const std::vector<char>& strings() const noexcept { return strings_; }
+
+private:
+    struct Line
+    {
+        std::string_view text, name, edits;
+        std::size_t number;
+    };
+    
+    fs::path path_;
+    MappedFile file_;
+    std::string_view remaining_;
+    std::optional<Tag::Name> value_tag_;
+    QnameOrder order_;
+    std::vector<std::pair<std::string_view, ReadEdits>> group_ {};
+    std::optional<Line> next_ {};
+    std::vector<EditTag> tags_ {};
+    std::vector<char> strings_ {};
+    std::string last_query_ {};
+    std::size_t line_number_ {0};
+
+    std::optional<Line> next_line()
+    {
+        while (!remaining_.empty()) {
+            const auto line = pop_line(remaining_);
+            ++line_number_;
+            if (!line.empty()) {
+                const auto [name, edits] = split_read_line(line);
+                return Line {line, name, edits, line_number_};
+            }
+        }
+        return std::nullopt;
+    }
+    
+    // Loads the next group of names
+    void advance()
+    {
+        group_.clear();
+        tags_.clear();
+        strings_.clear();
+        while (next_ && (group_.empty() || compare_qnames(next_->name, group_.front().first, order_) == 0)) {
+            const auto read_edits = parse_edits(next_->edits, value_tag_, tags_, strings_);
+            if (!read_edits) throw_error("Invalid line ", next_->number, " of ", path_, ": ", next_->text);
+            group_.emplace_back(next_->name, *read_edits);
+            next_ = next_line();
+        }
+        if (next_ && compare_qnames(next_->name, group_.front().first, order_) < 0) {
+            throw_error("Read names in ", path_, " are not sorted (line ", next_->number, ")");
+        }
+    }
+};
+
+template <typename Stats = NoStats>
+TagCounts 
+tag_sorted_reads(htsFile* src_bam,
+                 bam_hdr_t* header,
+                 htsFile* dst_bam,
+                 SortedReadList& reads,
+                 const std::optional<Tag>& tag = std::nullopt,
+                 const std::optional<std::uint16_t> flag = std::nullopt,
+                 const TargetRegions* targets = nullptr,
+                 const bool verbose = false,
+                 const bool timed = false,
+                 Stats* stats = nullptr)
+{
+    const std::size_t log_tick {10'000'000};
+    TagCounts counts {};
+    AuxEditor editor {};
+    std::unique_ptr<bam1_t, HtsBam1Deleter> rec {bam_init1(), HtsBam1Deleter {}};
+    StageClock clock {timed};
+    while (sam_read1(src_bam, header, rec.get()) >= 0) {
+        if (verbose && counts.reads > 0 and counts.reads % log_tick == 0) {
+            log_tag_progress(counts);
+        }
+        clock.lap(counts.times.decode);
+        ++counts.reads;
+        // Lookup includes streaming the list up to this read
+        const auto targeted = !targets || overlaps(*rec, *targets);
+        const auto edits = targeted ? reads.find(get_qname(*rec)) : nullptr;
+        clock.lap(counts.times.lookup);
+        if (edits) {
+            apply_edits(rec.get(), editor, *edits, reads.tags(), reads.strings(), tag, flag);
+            ++counts.marked;
+            clock.lap(counts.times.edit);
+        }
+        if constexpr (has_stats_v<Stats>) {
+            if (stats) add_read(*rec, *stats);
+            clock.lap(counts.times.stats);
+        }
+        if (sam_write1(dst_bam, header, rec.get()) < 0) throw_error("Error writing BAM");
+        clock.lap(counts.times.encode);
+    }
+    if (verbose) {
+        log_tag_progress(counts);
+    }
+    return counts;
+}
+
+constexpr std::array<std::uint8_t, 28> bgzf_eof_block {
+    0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 0x42, 0x43, 0x02, 0, 0x1b, 0, 0x03, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+// Size of a bgzf file without its EOF marker block, if it has one
+std::uint64_t bgzf_data_size(hFILE* file)
+{
+    const auto file_size = static_cast<std::uint64_t>(hseek(file, 0, SEEK_END));
+    std::array<std::uint8_t, 28> last_block {};
+    if (file_size >= last_block.size() && hseek(file, static_cast<off_t>(file_size - last_block.size()), SEEK_SET) >= 0
+     && hread(file, last_block.data(), last_block.size()) == static_cast<ssize_t>(last_block.size())
+     && last_block == bgzf_eof_block) {
+        return file_size - last_block.size();
+    }
+    return file_size;
+}
+
+// Copies the bgzf blocks of src_bam that contain no reads in targets to the
+// output without recompressing them. Only the blocks holding the index chunks
+// of the target regions are decoded, tagged and recompressed.
+TagCounts 
+tag_reads_passthrough(const fs::path& src_bam_path,
+                      htsFile* src_bam,
+                      bam_hdr_t* header,
+                      const std::optional<fs::path>& dst_bam_path,
+                      const ReadList& reads,
+                      const TargetRegions& targets,
+                      const std::optional<Tag>& tag = std::nullopt,
+                      const std::optional<std::uint16_t> flag = std::nullopt,
+                      hts_tpool* thread_pool = nullptr,
+                      const std::optional<int> compression_level = std::nullopt,
+                      const bool verbose = false,
+                      const bool timed = false)
+{
+    const auto format = hts_get_format(src_bam)->format;
+    if (format != bam) throw_error("--passthrough requires bam input");
+    std::unique_ptr<hts_idx_t, HtsIndexDeleter> index {sam_index_load(src_bam, src_bam_path.c_str()), HtsIndexDeleter {}};
+    if (!index) throw_error("--passthrough requires an indexed input");
+    std::vector<hts_pair64_max_t> chunks {};
+    if (has_intervals(targets)) {
+        const auto itr = query_regions(index.get(), header, targets);
+        chunks.assign(itr->off, itr->off + itr->n_off);
+    }
+    std::sort(std::begin(chunks), std::end(chunks), [] (const auto& lhs, const auto& rhs) { return lhs.u < rhs.u; });
+    BGZF* in {src_bam->fp.bgzf};
+    std::unique_ptr<hFILE, HFileDeleter> raw_in {hopen(src_bam_path.c_str(), "r"), HFileDeleter {}};
+    // Copied blocks keep their compression; only rewritten blocks use the level
+    const auto mode = "w" + (compression_level ? std::to_string(*compression_level) : "");
+    std::unique_ptr<BGZF, BgzfDeleter> out {open_output_bgzf(dst_bam_path, mode), BgzfDeleter {}};
+    if (!raw_in || !out) throw_error("Error opening files for --passthrough");
+    if (thread_pool) bgzf_thread_pool(out.get(), thread_pool, 0);
+    const auto check_write = [] (const bool ok) {
+        if (!ok) throw_error("Error writing BAM");
+    };
+    check_write(bam_hdr_write(out.get(), header) >= 0 && bgzf_flush(out.get()) >= 0);
+    std::vector<char> buffer(BGZF_MAX_BLOCK_SIZE);
+    // Recompresses the uncompressed bytes [from, from + length) of one block
+    const auto copy_decoded = [&] (const std::uint64_t from, const std::size_t length) {
+        if (length == 0) return;
+        check_write(bgzf_seek(in, static_cast<std::int64_t>(from), SEEK_SET) >= 0
+                 && bgzf_read(in, buffer.data(), length) == static_cast<ssize_t>(length)
+                 && bgzf_write(out.get(), buffer.data(), length) == static_cast<ssize_t>(length));
+    };
+    // Returns the compressed and uncompressed sizes of the block at address
+    const auto block_sizes = [&] (const std::uint64_t address) {
+        std::array<std::uint8_t, 18> block_header {};
+        std::array<std::uint8_t, 4> block_footer {};
+        check_write(hseek(raw_in.get(), static_cast<off_t>(address), SEEK_SET) >= 0
+                 && hread(raw_in.get(), block_header.data(), block_header.size()) == static_cast<ssize_t>(block_header.size()));
+        const std::size_t compressed_size = (block_header[16] | (block_header[17] << 8)) + 1;
+        check_write(hseek(raw_in.get(), static_cast<off_t>(address + compressed_size - block_footer.size()), SEEK_SET) >= 0
+                 && hread(raw_in.get(), block_footer.data(), block_footer.size()) == static_cast<ssize_t>(block_footer.size()));
+        const std::size_t uncompressed_size = block_footer[0] | (block_footer[1] << 8) | (block_footer[2] << 16) | (block_footer[3] << 24);
+        return std::make_pair(compressed_size, uncompressed_size);
+    };
+    const auto copy_raw = [&] (std::uint64_t from, const std::uint64_t to) {
+        check_write(bgzf_flush(out.get()) >= 0 && hseek(raw_in.get(), static_cast<off_t>(from), SEEK_SET) >= 0);
+        for (; from < to;) {
+            const auto length = std::min<std::uint64_t>(buffer.size(), to - from);
+            check_write(hread(raw_in.get(), buffer.data(), length) == static_cast<ssize_t>(length)
+                     && hwrite(out.get()->fp, buffer.data(), length) == static_cast<ssize_t>(length));
+            from += length;
+        }
+    };
+    // Copies the records in [from, to): whole blocks raw and partial blocks decoded
+    std::size_t copied_bytes {0};
+    const auto copy_records = [&] (const std::uint64_t from, const std::uint64_t to) {
+        if (from >= to) return;
+        const auto from_block = from >> 16, to_block = to >> 16;
+        if (from_block == to_block) {
+            copy_decoded(from, (to & 0xffff) - (from & 0xffff));
+            return;
+        }
+        auto raw_begin = from_block;
+        if ((from & 0xffff) != 0) {
+            const auto [compressed_size, uncompressed_size] = block_sizes(from_block);
+            copy_decoded(from, uncompressed_size - (from & 0xffff));
+            raw_begin += compressed_size;
+        }
+        copy_raw(raw_begin, to_block);
+        copied_bytes += to_block - raw_begin;
+        copy_decoded(to_block << 16, to & 0xffff);
+    };
+    TagCounts counts {};
+    AuxEditor editor {};
+    std::unique_ptr<bam1_t, HtsBam1Deleter> rec {bam_init1(), HtsBam1Deleter {}};
+    StageClock clock {timed};
+    auto position = static_cast<std::uint64_t>(bgzf_tell(in));
+    for (const auto& chunk : chunks) {
+        if (chunk.v <= position) continue;
+        copy_records(position, chunk.u);
+        position = std::max(position, chunk.u);
+        check_write(bgzf_seek(in, static_cast<std::int64_t>(position), SEEK_SET) >= 0);
+        clock = StageClock {timed}; // copied blocks are not part of any stage
+        while (static_cast<std::uint64_t>(bgzf_tell(in)) < chunk.v) {
+            if (bam_read1(in, rec.get()) < 0) break;
+            clock.lap(counts.times.decode);
+            tag_read(rec.get(), editor, reads, tag, flag, &targets, counts, clock);
+            check_write(bam_write1(out.get(), rec.get()) >= 0);
+            clock.lap(counts.times.encode);
+        }
+        position = static_cast<std::uint64_t>(bgzf_tell(in));
+    }
+    // Copy everything that remains except the EOF marker block
+    copy_records(position, bgzf_data_size(raw_in.get()) << 16);
+    check_write(bgzf_close(out.release()) >= 0);
+    if (verbose) {
+        log_tag_progress(counts);
+        std::clog << "Copied " << copied_bytes << " compressed bytes without decoding" << std::endl;
+    }
+    return counts;
+}
+
+// A contiguous part of a coordinate sorted file: the reads starting in each
+// range, in order, and the unplaced reads if it is the last shard.
+struct Shard
+{
+    struct Range
+    {
+        int tid;
+        hts_pos_t begin, end;
+    };
+    std::vector<Range> ranges;
+    bool unplaced = false;
+};
+
+// Splits the genome into num_shards shards with about the same number of
+// reads, using the index read counts (or contig lengths if the index has
+// none) and assuming uniform coverage within a contig. The index has no
+// counts for contigs without reads, which are weighted 0 but still placed
+// in a shard in case they do have reads.
+std::vector<Shard> make_shards(const bam_hdr_t& header, const hts_idx_t& index, const std::size_t num_shards)
+{
+    assert(num_shards > 0);
+    std::vector<double> weights(static_cast<std::size_t>(header.n_targets));
+    bool have_stats {false};
+    for (int tid {0}; tid < header.n_targets; ++tid) {
+        std::uint64_t mapped {0}, unmapped {0};
+        if (hts_idx_get_stat(&index, tid, &mapped, &unmapped) < 0) continue;
+        have_stats = true;
+        weights[static_cast<std::size_t>(tid)] = static_cast<double>(mapped + unmapped);
+    }
+    if (!have_stats) std::copy(header.target_len, header.target_len + header.n_targets, std::begin(weights));
+    const auto shard_weight = std::reduce(std::cbegin(weights), std::cend(weights)) / static_cast<double>(num_shards);
+    std::vector<Shard> result(num_shards);
+    std::size_t shard {0};
+    double filled {0};
+    for (int tid {0}; tid < header.n_targets; ++tid) {
+        auto weight = weights[static_cast<std::size_t>(tid)];
+        if (weight == 0) {
+            result[shard].ranges.push_back({tid, 0, std::numeric_limits<hts_pos_t>::max()});
+            continue;
+        }
+        const hts_pos_t length {header.target_len[tid]};
+        hts_pos_t begin {0};
+        while (shard + 1 < num_shards && filled + weight > shard_weight) {
+            const auto room = shard_weight - filled;
+            const auto end = begin + static_cast<hts_pos_t>(static_cast<double>(length - begin) * (room / weight));
+            if (end > begin) result[shard].ranges.push_back({tid, begin, end});
+            weight -= room;
+            begin = std::max(begin, end);
+            ++shard;
+            filled = 0;
+        }
+        // The last range of a contig also takes any reads past its end
+        result[shard].ranges.push_back({tid, begin, std::numeric_limits<hts_pos_t>::max()});
+        filled += weight;
+    }
+    result.back().unplaced = true;
+    return result;
+}
+
+// Tags the reads of one shard, writing them as a bgzf file which holds the
+// header only if write_header is set. As EOF marker blocks are empty, shards
+// can be concatenated as they are.
+template <typename Stats = NoStats>
+TagCounts 
+tag_shard(const fs::path& src_bam_path,
+          const fs::path& dst_bam_path,
+          const Shard& shard,
+          const bool write_header,
+          const ReadList& reads,
+          const std::optional<Tag>& tag,
+          const std::optional<std::uint16_t> flag,
+          const TargetRegions* targets,
+          const std::optional<fs::path>& reference,
+          const std::optional<int> compression_level,
+          const bool timed,
+          Stats* stats)
+{
+    const auto [src_bam, header] = open_bam(src_bam_path, nullptr, {reference});
+    std::unique_ptr<hts_idx_t, HtsIndexDeleter> index {sam_index_load(src_bam.get(), src_bam_path.c_str()), HtsIndexDeleter {}};
+    const auto mode = "w" + (compression_level ? std::to_string(*compression_level) : "");
+    std::unique_ptr<BGZF, BgzfDeleter> out {open_output_bgzf(dst_bam_path, mode), BgzfDeleter {}};
+    if (!index || !out) throw_error("Error opening files for shard ", dst_bam_path);
+    const auto check_write = [] (const bool ok) {
+        if (!ok) throw_error("Error writing BAM");
+    };
+    if (write_header) check_write(bam_hdr_write(out.get(), header.get()) >= 0);
+    TagCounts counts {};
+    AuxEditor editor {};
+    std::unique_ptr<bam1_t, HtsBam1Deleter> rec {bam_init1(), HtsBam1Deleter {}};
+    const auto tag_range = [&] (const int tid, const hts_pos_t begin, const hts_pos_t end) {
+        std::unique_ptr<hts_itr_t, HtsIteratorDeleter> itr {sam_itr_queryi(index.get(), tid, begin, end), HtsIteratorDeleter {}};
+        if (!itr) throw_error("Failed to query ", src_bam_path);
+        StageClock clock {timed};
+        while (sam_itr_next(src_bam.get(), itr.get(), rec.get()) >= 0) {
+            clock.lap(counts.times.decode);
+            // Reads overlapping the start of the range belong to the shard before
+            if (tid >= 0 && rec->core.pos < begin) continue;
+            tag_read(rec.get(), editor, reads, tag, flag, targets, counts, clock);
+            if constexpr (has_stats_v<Stats>) {
+                if (stats) add_read(*rec, *stats);
+                clock.lap(counts.times.stats);
+            }
+            check_write(bam_write1(out.get(), rec.get()) >= 0);
+            clock.lap(counts.times.encode);
+        }
+    };
+    for (const auto& range : shard.ranges) tag_range(range.tid, range.begin, range.end);
+    if (shard.unplaced) tag_range(HTS_IDX_NOCOOR, 0, 0);
+    check_write(bgzf_close(out.release()) >= 0);
+    return counts;
+}
+
+// Tags a coordinate sorted and indexed input in num_shards shards. If shard
+// is given, only that shard is written to dst_bam_path, and the full output
+// is the concatenation of all shards in order. Otherwise the shards are
+// tagged concurrently and their bgzf blocks, less EOF markers, are copied
+// into the output unchanged.
+template <typename Stats = NoStats>
+TagCounts 
+tag_reads_sharded(const fs::path& src_bam_path,
+                  const bam_hdr_t& header,
+                  const hts_idx_t& index,
+                  const std::optional<fs::path>& dst_bam_path,
+                  const ReadList& reads,
+                  const std::size_t num_shards,
+                  const std::optional<std::size_t> shard = std::nullopt,
+                  const std::optional<Tag>& tag = std::nullopt,
+                  const std::optional<std::uint16_t> flag = std::nullopt,
+                  const TargetRegions* targets = nullptr,
+                  const std::optional<fs::path>& reference = std::nullopt,
+                  const std::optional<int> compression_level = std::nullopt,
+                  const bool verbose = false,
+                  const bool timed = false,
+                  Stats* stats = nullptr)
+{
+    const auto shards = make_shards(header, index, num_shards);
+    TagCounts counts {};
+    if (shard) {
+        assert(*shard < num_shards);
+        counts = tag_shard(src_bam_path, dst_bam_path.value_or("-"), shards[*shard], *shard == 0, reads, tag, flag, targets, reference, compression_level, timed, stats);
+    } else {
+        const auto shard_path = [&] (const std::size_t i) {
+            const auto suffix = ".shard" + std::to_string(i) + ".tmp";
+            return dst_bam_path ? fs::path {dst_bam_path->string() + suffix}
+                                : fs::temp_directory_path() / ("samtag." + std::to_string(getpid()) + suffix);
+        };
+        std::vector<TagCounts> shard_counts(num_shards);
+        std::vector<Stats> shard_stats {};
+        if constexpr (has_stats_v<Stats>) {
+            if (stats) {
+                shard_stats.reserve(num_shards);
+                for (std::size_t i {0}; i < num_shards; ++i) shard_stats.push_back(*stats);
+            }
+        }
+        std::vector<std::thread> threads {};
+        std::vector<std::exception_ptr> errors(num_shards);
+        threads.reserve(num_shards);
+        for (std::size_t i {0}; i < num_shards; ++i) {
+            threads.push_back(start_thread([&, i] () {
+                shard_counts[i] = tag_shard(src_bam_path, shard_path(i), shards[i], i == 0, reads, tag, flag, targets,
+                                            reference, compression_level, timed, shard_stats.empty() ? nullptr : &shard_stats[i]);
+            }, errors[i]));
+        }
+        try {
+            join_threads(threads, errors);
+        } catch (...) {
+            std::error_code ignored {};
+            for (std::size_t i {0}; i < num_shards; ++i) fs::remove(shard_path(i), ignored);
+            throw;
+        }
+        std::unique_ptr<hFILE, HFileDeleter> out {open_stream(dst_bam_path.value_or("-"), "w"), HFileDeleter {}};
+        const auto check_write = [] (const bool ok) {
+            if (!ok) throw_error("Error writing BAM");
+        };
+        check_write(out != nullptr);
+        std::vector<char> buffer(1 << 20);
+        for (std::size_t i {0}; i < num_shards; ++i) {
+            std::unique_ptr<hFILE, HFileDeleter> in {hopen(shard_path(i).c_str(), "r"), HFileDeleter {}};
+            check_write(in != nullptr);
+            auto size = bgzf_data_size(in.get());
+            check_write(hseek(in.get(), 0, SEEK_SET) == 0);
+            while (size > 0) {
+                const auto length = std::min<std::uint64_t>(buffer.size(), size);
+                check_write(hread(in.get(), buffer.data(), length) == static_cast<ssize_t>(length)
+                         && hwrite(out.get(), buffer.data(), length) == static_cast<ssize_t>(length));
+                size -= length;
+            }
+            in.reset();
+            fs::remove(shard_path(i));
+            counts += shard_counts[i];
+        }
+        check_write(hwrite(out.get(), bgzf_eof_block.data(), bgzf_eof_block.size()) == static_cast<ssize_t>(bgzf_eof_block.size())
+                 && hclose(out.release()) == 0);
+        if constexpr (has_stats_v<Stats>) {
+            if (stats) {
+                *stats = std::move(shard_stats.front());
+                std::for_each(std::next(std::cbegin(shard_stats)), std::cend(shard_stats), [&] (const auto& other) { *stats += other; });
+            }
+        }
+    }
+    if (verbose) {
+        log_tag_progress(counts);
+        if (reads.filter) log_filter_stats(counts);
+    }
+    return counts;
+}
+
+// Hit list written by tag --hits: the resolved edits of each listed record
+// of an input, in input order, identified by its ordinal in the input. Each
+// hit is a HitHeader followed by its tags, with the value of each string tag
+// following the tag. merge-hits applies the hit lists of all partitions of a
+// read list to the input.
+struct HitListHeader
+{
+    std::array<char, 8> magic;
+    std::uint32_t version, reserved;
+};
+
+struct HitHeader
+{
+    std::uint64_t record;
+    std::uint16_t flag, num_tags;
+    std::uint32_t reserved;
+};
+
+// Written as is, so without padding
+static_assert(std::has_unique_object_representations_v<HitListHeader> && std::has_unique_object_representations_v<HitHeader>);
+
+constexpr std::array<char, 8> hit_list_magic {'S', 'A', 'M', 'T', 'A', 'G', 'H', 'L'};
+constexpr std::uint32_t hit_list_version {1};
+
+class HitListWriter
+{
+public:
+    HitListWriter(const fs::path& path, const std::optional<Tag>& tag, const std::optional<std::uint16_t> flag)
+    : path_ {path}
+    , file_ {path, std::ios::binary}
+    , flag_ {flag.value_or(0)}
+    {
+        if (tag) add_edit_tag(*tag, default_tags_, default_strings_);
+        // As for tagging, a default tag without a value only names the values in the list
+        if (!default_tags_.empty() && default_tags_.front().type == 'Z' && default_tags_.front().length == 0) default_tags_.clear();
+        write(HitListHeader {hit_list_magic, hit_list_version, 0});
+    }
+    
+    void add(const std::uint64_t record, const ReadEdits& edits, const std::span<const EditTag> tags, const std::span<const char> strings)
+    {
+        const auto read_tags = tags.subspan(edits.tags_begin, edits.num_tags);
+        write(HitHeader {record, static_cast<std::uint16_t>(flag_ | edits.flag), 
+                         static_cast<std::uint16_t>(default_tags_.size() + read_tags.size()), 0});
+        for (const auto& tag : default_tags_) write_tag(tag, default_strings_);
+        for (const auto& tag : read_tags) write_tag(tag, strings);
+    }
+    
+    void close()
+    {
+        if (!file_.flush()) throw_error("Failed to write ", path_);
+        file_.close();
+    }
+
+private:
+    fs::path path_;
+    std::ofstream file_;
+    std::uint16_t flag_;
+    std::vector<EditTag> default_tags_;
+    std::vector<char> default_strings_;
+    
+    template <typename T>
+    void write(const T& value)
+    {
+        file_.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    void write_tag(EditTag tag, const std::span<const char> strings)
+    {
+        if (tag.type == 'Z') {
+            const auto value = tag.value;
+            tag.value = 0;
+            write(tag);
+            file_.write(strings.data() + value, tag.length);
+        } else {
+            write(tag);
+        }
+    }
+};
+
+class HitListReader
+{
+public:
+    explicit HitListReader(const fs::path& path) : path_ {path}, file_ {path, std::ios::binary}
+    {
+        HitListHeader header {};
+        if (!read(header) || header.magic != hit_list_magic) fail("not a hit list");
+        if (header.version != hit_list_version) fail("unsupported version");
+        next();
+    }
+    
+    // Loads the next hit, if any
+    void next()
+    {
+        HitHeader header {};
+        if (!read(header)) {
+            if (!file_.eof() || file_.gcount() != 0) fail("truncated");
+            done_ = true;
+            return;
+        }
+        if (header_ && header.record < header_->record) fail("records out of order");
+        header_ = header;
+        tags_.resize(header.num_tags);
+        strings_.clear();
+        for (auto& tag : tags_) {
+            if (!read(tag)) fail("truncated");
+            if (tag.type == 'Z') {
+                tag.value = strings_.size();
+                strings_.resize(strings_.size() + tag.length);
+                if (!file_.read(strings_.data() + tag.value, tag.length)) fail("truncated");
+            }
+        }
+    }
+    
+    bool done() const noexcept { return done_; }
+    std::uint64_t record() const noexcept { return header_->record; }
+    std::uint16_t flag() const noexcept { return header_->flag; }
+    std::span<const EditTag> tags() const noexcept { return tags_; }
+    std::span<const char> strings() const noexcept { return strings_; }
+    const fs::path& path() const noexcept { return path_; }
+
+private:
+    fs::path path_;
+    std::ifstream file_;
+    std::optional<HitHeader> header_ {};
+    std::vector<EditTag> tags_ {};
+    std::vector<char> strings_ {};
+    bool done_ {false};
+    
+    template <typename T>
+    bool read(T& value)
+    {
+        return static_cast<bool>(file_.read(reinterpret_cast<char*>(&value), sizeof(value)));
+    }
+    [[noreturn]] void fail(const std::string_view reason) const
+    {
+        throw_error("Invalid hit list ", path_, ": ", reason);
+    }
+};
+
+// Writes a hit for each listed read of src_bam rather than tagging it
+TagCounts 
+find_hits(htsFile* src_bam,
+          bam_hdr_t* header,
+          const fs::path& hits_path,
+          const ReadList& reads,
+          const std::optional<Tag>& tag = std::nullopt,
+          const std::optional<std::uint16_t> flag = std::nullopt,
+          const TargetRegions* targets = nullptr,
+          const bool verbose = false,
+          const bool timed = false)
+{
+    const std::size_t log_tick {10'000'000};
+    TagCounts counts {};
+    HitListWriter hits {hits_path, tag, flag};
+    std::unique_ptr<bam1_t, HtsBam1Deleter> rec {bam_init1(), HtsBam1Deleter {}};
+    StageClock clock {timed};
+    for (std::uint64_t record {0}; sam_read1(src_bam, header, rec.get()) >= 0; ++record) {
+        if (verbose && counts.reads > 0 and counts.reads % log_tick == 0) {
+            log_tag_progress(counts);
+        }
+        clock.lap(counts.times.decode);
+        const auto edits = find_read(*rec, reads, targets, counts);
+        clock.lap(counts.times.lookup);
+        if (!edits) continue;
+        ++counts.marked;
+        hits.add(record, *edits, edit_tags(reads), edit_strings(reads));
+        clock.lap(counts.times.encode);
+    }
+    hits.close();
+    if (verbose) {
+        log_tag_progress(counts);
+        if (reads.filter) log_filter_stats(counts);
+    }
+    return counts;
+}
+
+//
+// index-reads
+//
+
+void run_index_reads(const IndexReadsOptions& options)
+{
+    WorkerPool workers {options.threads > 1 ? static_cast<std::size_t>(options.threads) : 0};
+    const auto reads = load_reads(options.qname_tsv_path, options.value_tag, true, &workers, options.verbose);
+    auto output = options.output.value_or(options.qname_tsv_path.string() + ".idx");
+    write_read_index(reads, options.value_tag, output);
+    if (options.verbose > 0) {
+        std::clog << "Wrote " << reads.names.size() << " read names to " << output << std::endl;
+    }
+}
+
+//
+// merge-hits
+//
+
+// Applies the hits to the records of src_bam they were found for. The hit
+// lists must have been made from the same input.
+TagCounts 
+merge_hits(htsFile* src_bam,
+           bam_hdr_t* header,
+           htsFile* dst_bam,
+           std::vector<HitListReader>& hits,
+           const bool verbose = false)
+{
+    const std::size_t log_tick {10'000'000};
+    TagCounts counts {};
+    AuxEditor editor {};
+    const auto next_record = [&] () {
+        auto result = std::numeric_limits<std::uint64_t>::max();
+        for (const auto& list : hits) {
+            if (!list.done()) result = std::min(result, list.record());
+        }
+        return result;
+    };
+    std::unique_ptr<bam1_t, HtsBam1Deleter> rec {bam_init1(), HtsBam1Deleter {}};
+    auto next = next_record();
+    for (std::uint64_t record {0}; sam_read1(src_bam, header, rec.get()) >= 0; ++record) {
+        if (verbose && counts.reads > 0 and counts.reads % log_tick == 0) {
+            log_tag_progress(counts);
+        }
+        ++counts.reads;
+        if (record == next) {
+            ++counts.marked;
+            for (auto& list : hits) {
+                for (; !list.done() && list.record() == record; list.next()) {
+                    rec->core.flag |= list.flag();
+                    for (const auto& tag : list.tags()) editor.add(get_tag(tag, list.strings()));
+                    editor.apply(rec.get());
+                }
+            }
+            next = next_record();
+        }
+        if (sam_write1(dst_bam, header, rec.get()) < 0) throw_error("Error writing BAM");
+    }
+    for (const auto& list : hits) {
+        if (!list.done()) throw_error("Invalid hit list ", list.path(), ": records beyond the end of the input");
+    }
+    if (verbose) log_tag_progress(counts);
+    return counts;
+}
+
+void run_merge_hits(const MergeHitsOptions& options)
+{
+    std::vector<HitListReader> hits {};
+    hits.reserve(options.hits_paths.size());
+    for (const auto& path : options.hits_paths) hits.emplace_back(path);
+    const auto thread_pool = make_thread_pool(options.threads);
+    bool index_on_write {false};
+    {
+        auto [src_bam, header] = open_bam(options.src_bam_path, thread_pool.get(), {options.reference});
+        index_on_write = options.build_index && options.output && is_coordinate_sorted(*header)
+                      && is_indexable_mode(get_output_mode(options.output, options.output_format));
+        const auto dst_bam = open_tag_output(options.output, *header, thread_pool.get(), src_bam.get(), options.reference, 
+                                             index_on_write, options.output_format);
+        merge_hits(src_bam.get(), header.get(), dst_bam.get(), hits, options.verbose);
+        if (index_on_write && sam_idx_save(dst_bam.get()) < 0) throw_error("Failed to save index for ", *options.output);
+    }
+    if (options.build_index && options.output && !index_on_write
+     && sam_index_build3(options.output->c_str(), nullptr, 0, options.threads) < 0) {
+        std::clog << "Failed to build bam index for " << *options.output << std::endl;
+    }
+}
+
+//
+// stats
+//
+
+// One TAG[:PATTERN] per line, as for --tag. Blank lines and lines starting
+// with '#' are skipped.
+std::vector<SearchTag> read_search_tags(const fs::path& tag_path)
+{
+    std::vector<SearchTag> result {};
+    std::ifstream file {tag_path};
+    if (!file) throw_error("Failed to open ", tag_path);
+    for (std::string line {}; std::getline(file, line);) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line.front() == '#') continue;
+        result.push_back(parse_search_tag(line));
+    }
+    return result;
+}
+
+TagStats init_stats(const StatsOptions& options)
+{
+    return init_stats(options.tags, options.split, options.top, options.distinct);
+}
+
+enum ReadCondition : unsigned
+{
+    flags = 1,
+    mapping_quality = 2,
+    read_length = 4,
+    contig = 8
+};
+
+struct ReadFilterParameters
+{
+    unsigned conditions = 0;
+    std::uint16_t flag_mask = 0, flag_value = 0;
+    std::uint8_t min_mapping_quality = 0;
+    std::int32_t min_length = 0;
+    std::vector<char> contigs {}; // by tid
+};
+
+// Only the conditions in use are compiled into the predicate.
+template <unsigned Conditions>
+struct ReadFilter
+{
+    const ReadFilterParameters& parameters;
+    
+    bool operator()(const bam1_t& read) const noexcept
+    {
+        if constexpr ((Conditions & ReadCondition::flags) != 0) {
+            if ((read.core.flag & parameters.flag_mask) != parameters.flag_value) return false;
+        }
+        if constexpr ((Conditions & ReadCondition::mapping_quality) != 0) {
+            if (read.core.qual < parameters.min_mapping_quality) return false;
+        }
+        if constexpr ((Conditions & ReadCondition::read_length) != 0) {
+            if (read.core.l_qseq < parameters.min_length) return false;
+        }
+        if constexpr ((Conditions & ReadCondition::contig) != 0) {
+            const auto tid = static_cast<std::size_t>(read.core.tid);
+            if (tid >= parameters.contigs.size() || !parameters.contigs[tid]) return false;
+        }
+        return true;
+    }
+};
+
+auto make_read_filter(const StatsOptions& options, const bam_hdr_t& header)
+{
+    ReadFilterParameters result {};
+    if (options.require_flags || options.exclude_flag || options.proper_pair) {
+        result.conditions |= ReadCondition::flags;
+        result.flag_value = options.require_flags.value_or(0);
+        if (options.proper_pair) result.flag_value |= BAM_FPAIRED | BAM_FPROPER_PAIR;
+        const auto exclude_flag = options.exclude_flag.value_or(0);
+        result.flag_mask = result.flag_value | exclude_flag;
+        // A bit both required and excluded passes no reads: with no bits
+        // masked the (non-zero) required value is never matched
+        if ((result.flag_value & exclude_flag) != 0) result.flag_mask = 0;
+    }
+    if (options.min_mapping_quality) {
+        result.conditions |= ReadCondition::mapping_quality;
+        result.min_mapping_quality = static_cast<std::uint8_t>(std::clamp(*options.min_mapping_quality, 0, 255));
+    }
+    if (options.min_length) {
+        result.conditions |= ReadCondition::read_length;
+        result.min_length = *options.min_length;
+    }
+    if (!options.contigs.empty()) {
+        result.conditions |= ReadCondition::contig;
+        result.contigs.resize(header.n_targets);
+        for (const auto& contig : options.contigs) {
+            const auto tid = sam_hdr_name2tid(const_cast<bam_hdr_t*>(&header), contig.c_str());
+            if (tid < 0) throw_error("ERROR: contig ", contig, " is not in the input header.");
+            result.contigs[tid] = true;
+        }
+    }
+    return result;
+}
+
+template <typename F, unsigned... Conditions>
+void visit_read_filter(const ReadFilterParameters& parameters, F&& f, std::integer_sequence<unsigned, Conditions...>)
+{
+    ((parameters.conditions == Conditions ? (f(ReadFilter<Conditions> {parameters}), true) : false) || ...);
+}
+
+// Calls f with the ReadFilter specialised for the conditions in parameters.
+template <typename F>
+void visit_read_filter(const ReadFilterParameters& parameters, F&& f)
+{
+    visit_read_filter(parameters, std::forward<F>(f), std::make_integer_sequence<unsigned, 16> {});
+}
+
+void log_progress(const TagStats& stats, const std::size_t total_reads, const int verbosity, const bool force = false)
+{
+    constexpr static std::size_t log_tick {10'000'000};
+    if (verbosity > 0 && ((total_reads > 0 && (total_reads % log_tick == 0)) || force)) {
+         std::clog << "Processed " << total_reads << " reads (used " << stats.total_reads << ")" << std::endl;
+    }
+}
+
+// A unit of work for parallel stats. Reads starting before min_pos are
+// counted by the region holding the preceding intervals.
+struct StatsRegion
+{
+    int tid;
+    std::vector<hts_pair_pos_t> intervals;
+    hts_pos_t min_pos;
+};
+
+auto 
+make_stats_regions(const bam_hdr_t& header,
+                   const hts_idx_t& index,
+                   const std::optional<TargetRegions>& targets,
+                   const std::size_t num_regions)
+{
+    std::vector<StatsRegion> result {};
+    if (targets) {
+        hts_pos_t total_bases {0};
+        for (const auto& intervals : targets->intervals) {
+            for (const auto& interval : intervals) total_bases += length(interval);
+        }
+        const auto region_bases = std::max(total_bases / static_cast<hts_pos_t>(num_regions), hts_pos_t {1});
+        for (int tid {0}; tid < static_cast<int>(targets->intervals.size()); ++tid) {
+            const auto& intervals = targets->intervals[tid];
+            for (std::size_t i {0}; i < intervals.size();) {
+                StatsRegion region {tid, {}, i > 0 ? intervals[i - 1].end : 0};
+                for (hts_pos_t bases {0}; i < intervals.size() && bases < region_bases; ++i) {
+                    region.intervals.push_back(intervals[i]);
+                    bases += length(intervals[i]);
+                }
+                result.push_back(std::move(region));
+            }
+        }
+    } else {
+        hts_pos_t total_bases {0};
+        for (int tid {0}; tid < header.n_targets; ++tid) total_bases += header.target_len[tid];
+        const auto region_bases = std::max(total_bases / static_cast<hts_pos_t>(num_regions), hts_pos_t {1});
+        for (int tid {0}; tid < header.n_targets; ++tid) {
+            std::uint64_t mapped {0}, unmapped {0};
+            if (hts_idx_get_stat(&index, tid, &mapped, &unmapped) == 0 && mapped + unmapped == 0) continue;
+            // The last window is open ended, for reads placed past the contig end
+            const hts_pos_t contig_length = header.target_len[tid];
+            for (hts_pos_t beg {0};; beg += region_bases) {
+                const auto last = beg + region_bases >= contig_length;
+                result.push_back({tid, {{beg, last ? std::numeric_limits<hts_pos_t>::max() : beg + region_bases}}, beg});
+                if (last) break;
+            }
+        }
+        result.push_back({HTS_IDX_NOCOOR, {}, 0});
+    }
+    return result;
+}
+
+// CRAM input only decodes the fields used by the read filter, by index
+// queries, and by tag counting. MD and NM are only generated if searched for.
+void set_required_fields(htsFile* bam, const StatsOptions& options, const bool indexed)
+{
+    if (!bam->is_cram) return;
+    int fields {SAM_FLAG | SAM_MAPQ | SAM_AUX | SAM_RGAUX};
+    if (indexed || !options.contigs.empty()) fields |= SAM_RNAME;
+    if (indexed) fields |= SAM_POS | SAM_CIGAR;
+    if (options.min_length) fields |= SAM_SEQ;
+    hts_set_opt(bam, CRAM_OPT_REQUIRED_FIELDS, fields);
+    const auto decode_md = std::any_of(std::cbegin(options.tags), std::cend(options.tags), [] (const SearchTag& tag) {
+        return tag.id == Tag::Name {'M', 'D'} || tag.id == Tag::Name {'N', 'M'};
+    });
+    if (!decode_md) hts_set_opt(bam, CRAM_OPT_DECODE_MD, 0);
+}
+
+template <typename Filter>
+auto 
+compute_stats(const StatsOptions& options,
+              htsFile* bam,
+              bam_hdr_t* header,
+              const hts_idx_t* index,
+              const std::optional<TargetRegions>& targets,
+              const Filter& read_filter)
+{
+    auto stats = init_stats(options);
+    std::size_t tot_reads {0};
+    std::unique_ptr<bam1_t, HtsBam1Deleter> read {bam_init1(), HtsBam1Deleter {}};
+    int r {-1};
+    if (targets && has_intervals(*targets)) {
+        const auto itr = query_regions(index, header, *targets);
+        while ((r = sam_itr_next(bam, itr.get(), read.get())) >= 0) {
+            if (read_filter(*read)) {
+                add_read(*read, stats);
+            }
+            log_progress(stats, ++tot_reads, options.verbose);
+        }
+    } else if (!targets) {
+        while ((r = sam_read1(bam, header, read.get())) >= 0) {
+            if (read_filter(*read)) {
+                add_read(*read, stats);
+            }
+            log_progress(stats, ++tot_reads, options.verbose);
+        }
+    }
+    if (r < -1) throw_error("Error reading ", options.bam_path);
+    return std::make_pair(std::move(stats), tot_reads);
+}
+
+template <typename Filter>
+auto 
+compute_stats_parallel(const StatsOptions& options,
+                       htsFile* primary_bam,
+                       const bam_hdr_t& header,
+                       const hts_idx_t& index,
+                       const std::optional<TargetRegions>& targets,
+                       const Filter& read_filter)
+{
+    if (targets && !has_intervals(*targets)) return std::make_pair(init_stats(options), std::size_t {0});
+    const auto num_threads = static_cast<std::size_t>(options.threads);
+    const auto regions = make_stats_regions(header, index, targets, 8 * num_threads);
+    std::atomic<std::size_t> next_region {0};
+    std::vector<TagStats> thread_stats(num_threads);
+    std::vector<std::size_t> thread_reads(num_threads);
+    std::vector<std::thread> threads {};
+    std::vector<std::exception_ptr> errors(num_threads);
+    for (std::size_t t {0}; t < num_threads; ++t) {
+        threads.push_back(start_thread([&, t] () {
+            auto [bam, bam_header] = open_bam(options.bam_path, nullptr, {options.reference, primary_bam});
+            set_required_fields(bam.get(), options, true);
+            std::unique_ptr<hts_idx_t, HtsIndexDeleter> bam_index {sam_index_load(bam.get(), options.bam_path.c_str()), HtsIndexDeleter {}};
+            if (!bam_index) throw_error("Error loading index for ", options.bam_path);
+            std::unique_ptr<bam1_t, HtsBam1Deleter> read {bam_init1(), HtsBam1Deleter {}};
+            auto stats = init_stats(options);
+            std::size_t tot_reads {0};
+            for (auto r = next_region++; r < regions.size(); r = next_region++) {
+                const auto& region = regions[r];
+                const auto itr = region.tid == HTS_IDX_NOCOOR
+                    ? std::unique_ptr<hts_itr_t, HtsIteratorDeleter> {sam_itr_queryi(bam_index.get(), HTS_IDX_NOCOOR, 0, 0), HtsIteratorDeleter {}}
+                    : query_regions(bam_index.get(), bam_header.get(), std::vector<ContigIntervals> {{region.tid, region.intervals}});
+                int res;
+                while ((res = sam_itr_next(bam.get(), itr.get(), read.get())) >= 0) {
+                    if (read->core.pos < region.min_pos) continue;
+                    if (read_filter(*read)) {
+                        add_read(*read, stats);
+                    }
+                    ++tot_reads;
+                }
+                if (res < -1) throw_error("Error reading ", options.bam_path);
+            }
+            thread_stats[t] = std::move(stats);
+            thread_reads[t] = tot_reads;
+        }, errors[t]));
+    }
+    join_threads(threads, errors);
+    auto result = std::move(thread_stats.front());
+    std::for_each(std::next(std::cbegin(thread_stats)), std::cend(thread_stats), [&] (const auto& stats) { result += stats; });
+    return std::make_pair(std::move(result), std::reduce(std::cbegin(thread_reads), std::cend(thread_reads)));
+}
+
+void run_stats(StatsOptions options)
+{
+    std::optional<StreamRelay> stdin_relay {};
+    if (options.bam_path == "-") stdin_relay.emplace(StreamRelay::Stream::in);
+    if (options.tag_path) {
+        const auto file_tags = read_search_tags(*options.tag_path);
+        options.tags.insert(std::end(options.tags), std::cbegin(file_tags), std::cend(file_tags));
+    }
+    // Multiple threads split the input by region when it is indexed, and 
+    // otherwise share a bgzf thread pool.
+    const auto try_parallel = options.threads > 1 && options.bam_path != "-";
+    auto thread_pool = make_thread_pool(try_parallel ? 1 : options.threads);
+    auto [bam, header] = open_bam(options.bam_path, thread_pool.get(), {options.reference});
+    std::unique_ptr<hts_idx_t, HtsIndexDeleter> index {};
+    if (try_parallel || options.bed_path) {
+        index.reset(sam_index_load(bam.get(), options.bam_path.c_str()));
+    }
+    if (options.bed_path && !index) throw_error("Error loading index for ", options.bam_path);
+    if (try_parallel && !index) {
+        thread_pool = make_thread_pool(options.threads);
+        std::tie(bam, header) = open_bam(options.bam_path, thread_pool.get(), {options.reference});
+    }
+    set_required_fields(bam.get(), options, options.bed_path.has_value());
+    std::optional<TargetRegions> targets {};
+    if (options.bed_path) {
+        targets = get_target_regions(*options.bed_path, *header);
+        if (options.verbose > 0) {
+            auto interval_stats = calculate_interval_stats(*targets);
+            std::clog << "Loaded " << interval_stats.num_targets << " non-overlapping targets ("
+                      << interval_stats.num_bases << " bp) in " << interval_stats.num_contigs << " contigs " << std::endl;
+        }
+    }
+    const auto read_filter = make_read_filter(options, *header);
+    auto stats = init_stats(options);
+    if (options.verbose > 0) {
+        std::clog << "Loaded " << stats.counts.size() << " tags" << std::endl;
+    }
+    std::size_t tot_reads {0};
+    visit_read_filter(read_filter, [&] (const auto& filter) {
+        if (try_parallel && index) {
+            std::tie(stats, tot_reads) = compute_stats_parallel(options, bam.get(), *header, *index, targets, filter);
+        } else {
+            std::tie(stats, tot_reads) = compute_stats(options, bam.get(), header.get(), index.get(), targets, filter);
+        }
+    });
+    bam.reset();
+    if (stdin_relay) stdin_relay->close();
+    log_progress(stats, tot_reads, options.verbose, true);
+    if (options.output) {
+        std::ofstream output {*options.output};
+        write(stats, output, options.sort);
+    } else {
+        write(stats, std::cout, options.sort);
+    }
+}
+
+//
+// tag command
+//
+
+auto get_output_path(const std::optional<fs::path>& output, const fs::path& src_bam_path)
+{
+    std::optional<fs::path> result {};
+    if (output) {
+        constexpr std::string_view stem_field {"{stem}"};
+        const auto stem = src_bam_path.stem().string();
+        auto path = output->string();
+        for (auto pos = path.find(stem_field); pos != std::string::npos; pos = path.find(stem_field, pos + stem.size())) {
+            path.replace(pos, stem_field.size(), stem);
+        }
+        result = std::move(path);
+    }
+    return result;
+}
+
+// --profile
+
+struct ResourceUsage
+{
+    std::chrono::steady_clock::time_point time;
+    double cpu_seconds; // of all threads
+};
+
+ResourceUsage get_resource_usage() noexcept
+{
+    rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    const auto seconds = [] (const timeval& t) { return static_cast<double>(t.tv_sec) + static_cast<double>(t.tv_usec) * 1e-6; };
+    return {std::chrono::steady_clock::now(), seconds(usage.ru_utime) + seconds(usage.ru_stime)};
+}
+
+std::size_t get_peak_rss() noexcept
+{
+    rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024; // ru_maxrss is in KiB
+}
+
+struct StageUsage
+{
+    double wall_seconds = 0, cpu_seconds = 0;
+};
+
+StageUsage operator-(const ResourceUsage& end, const ResourceUsage& begin) noexcept
+{
+    return {std::chrono::duration<double> {end.time - begin.time}.count(), end.cpu_seconds - begin.cpu_seconds};
+}
+
+StageUsage operator-(const StageUsage& lhs, const StageUsage& rhs) noexcept
+{
+    return {lhs.wall_seconds - rhs.wall_seconds, lhs.cpu_seconds - rhs.cpu_seconds};
+}
+
+struct FileProfile
+{
+    fs::path input;
+    std::optional<fs::path> output;
+    TagCounts counts;
+    StageUsage tag, index;
+};
+
+struct TagProfile
+{
+    ResourceUsage start {get_resource_usage()};
+    std::optional<StageUsage> load;
+    std::vector<FileProfile> files;
+};
+
+void write_json(const std::string_view str, std::ostream& os)
+{
+    os << '"';
+    for (const char c : str) {
+        if (c == '"' || c == '\\') {
+            os << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            std::array<char, 8> escaped {};
+            std::snprintf(escaped.data(), escaped.size(), "\\u%04x", c);
+            os << escaped.data();
+        } else {
+            os << c;
+        }
+    }
+    os << '"';
+}
+
+void write_json(const StageUsage& usage, std::ostream& os)
+{
+    os << "{\"wall_seconds\": " << usage.wall_seconds << ", \"cpu_seconds\": " << usage.cpu_seconds << "}";
+}
+
+double per_second(const std::size_t items, const double seconds) noexcept
+{
+    return seconds > 0 ? static_cast<double>(items) / seconds : 0;
+}
+
+// Stage times are summed over the threads doing them, so may exceed the wall
+// time of the pass in which they are run.
+void write_profile(const TagProfile& profile, const TagOptions& options, const ReadList* reads, std::ostream& os)
+{
+    const auto total = get_resource_usage() - profile.start;
+    os << "{\n";
+    os << "  \"command\": \"tag\",\n";
+    os << "  \"threads\": " << options.threads << ",\n";
+    os << "  \"jobs\": " << options.jobs << ",\n";
+    os << "  \"wall_seconds\": " << total.wall_seconds << ",\n";
+    os << "  \"cpu_seconds\": " << total.cpu_seconds << ",\n";
+    os << "  \"peak_rss_bytes\": " << get_peak_rss() << ",\n";
+    os << "  \"read_list\": ";
+    if (reads) {
+        os << "{\"path\": ";
+        write_json(options.qname_tsv_path.string(), os);
+        os << ", \"reads\": " << reads->names.size() << ", \"memory_bytes\": " << memory_usage(*reads)
+           << ", \"load_factor\": " << reads->names.load_factor();
+        if (profile.load) {
+            os << ", \"load\": ";
+            write_json(*profile.load, os);
+            os << ", \"reads_per_second\": " << per_second(reads->names.size(), profile.load->wall_seconds);
+        }
+        os << "},\n";
+    } else {
+        os << "null,\n";
+    }
+    os << "  \"files\": [";
+    for (std::size_t i {0}; i < profile.files.size(); ++i) {
+        const auto& file = profile.files[i];
+        const auto& counts = file.counts;
+        os << (i > 0 ? "," : "") << "\n    {\"input\": ";
+        write_json(file.input.string(), os);
+        os << ", \"output\": ";
+        if (file.output) {
+            write_json(file.output->string(), os);
+        } else {
+            os << "null";
+        }
+        os << ",\n     \"reads\": " << counts.reads << ", \"marked\": " << counts.marked << ", \"filtered\": " << counts.filtered
+           << ", \"reads_per_second\": " << per_second(counts.reads, file.tag.wall_seconds) << ",\n     \"tag\": ";
+        write_json(file.tag, os);
+        os << ",\n     \"stages\": {";
+        const std::array<std::pair<std::string_view, StageTimes::Duration>, 5> stages {{
+            {"decode", counts.times.decode}, {"lookup", counts.times.lookup}, {"edit", counts.times.edit},
+            {"stats", counts.times.stats}, {"encode", counts.times.encode}}};
+        for (std::size_t s {0}; s < stages.size(); ++s) {
+            const auto seconds = std::chrono::duration<double> {stages[s].second}.count();
+            os << (s > 0 ? ", " : "") << "\"" << stages[s].first << "\": {\"seconds\": " << seconds
+               << ", \"reads_per_second\": " << per_second(counts.reads, seconds) << "}";
+        }
+        os << "},\n     \"index\": ";
+        write_json(file.index, os);
+        os << "}";
+    }
+    os << "\n  ]\n}" << std::endl;
+}
+
+template <typename GetReads>
+void tag_file(const TagOptions& options,
+              const fs::path& src_bam_path,
+              const std::optional<Tag::Name>& value_tag,
+              const bool read_index,
+              GetReads&& get_reads,
+              hts_tpool* thread_pool,
+              WorkerPool& workers,
+              FileProfile* profile = nullptr)
+{
+    const auto tag_start = get_resource_usage();
+    const auto output = get_output_path(options.output, src_bam_path);
+    std::optional<TagStats> stats {};
+    if (!options.stats_tags.empty()) {
+        StatsOptions stats_options {};
+        stats_options.tags = options.stats_tags;
+        stats_options.split = options.split_stats;
+        stats = init_stats(stats_options);
+    }
+    auto [src_bam, header] = open_bam(src_bam_path, thread_pool, {options.reference});
+    std::optional<TargetRegions> targets {};
+    if (options.bed_path) {
+        targets = get_target_regions(*options.bed_path, *header);
+    }
+    auto qname_order = get_qname_order(*header);
+    if (options.name_sorted && !qname_order) qname_order = QnameOrder::natural;
+    if (qname_order && options.passthrough) throw_error("ERROR: --passthrough requires a coordinate sorted input.");
+    const auto sharded = options.shards > 1 || options.shard;
+    if (sharded && !is_coordinate_sorted(*header)) throw_error("ERROR: --shards requires a coordinate sorted input.");
+    // The index is built while writing when the output is coordinate sorted
+    // BGZF or CRAM, and otherwise from the finished file, which only warns if
+    // the output cannot be indexed
+    const auto indexable_output = is_indexable_mode(get_output_mode(output, options.output_format));
+    const auto index_on_write = options.build_index && output && indexable_output && is_coordinate_sorted(*header)
+                             && !options.passthrough && !sharded;
+    std::optional<ResourceUsage> index_start {};
+    const auto save_index = [&] (htsFile* dst_bam) {
+        index_start = get_resource_usage();
+        if (index_on_write && sam_idx_save(dst_bam) < 0) throw_error("Failed to save index for ", *output);
+    };
+    const auto compression_level = options.output_format.uncompressed ? 0 : options.output_format.compression_level;
+    // Unsorted read lists are loaded as usual
+    auto stream_reads = qname_order && !read_index && !options.partition && !options.hits && !sharded;
+    if (stream_reads && !is_sorted_read_list(options.qname_tsv_path, *qname_order)) {
+        if (options.verbose > 0) std::clog << "Loading unsorted " << options.qname_tsv_path << std::endl;
+        stream_reads = false;
+    }
+    // Loading the read list, or waiting for another job to load it, is
+    // profiled as the load rather than as tagging this file
+    StageUsage load_wait {};
+    const ReadList* reads {nullptr};
+    if (!stream_reads) {
+        const auto wait_start = get_resource_usage();
+        reads = &get_reads();
+        load_wait = get_resource_usage() - wait_start;
+    }
+    TagCounts counts {};
+    if (options.hits) {
+        counts = find_hits(src_bam.get(), header.get(), *get_output_path(options.hits, src_bam_path), *reads,
+                           options.tag, options.flag, targets ? &*targets : nullptr, options.verbose, profile != nullptr);
+    } else if (sharded) {
+        std::unique_ptr<hts_idx_t, HtsIndexDeleter> index {sam_index_load(src_bam.get(), src_bam_path.c_str()), HtsIndexDeleter {}};
+        if (!index) throw_error("ERROR: --shards requires an indexed input.");
+        counts = tag_reads_sharded(src_bam_path, *header, *index, output, *reads, options.shards, options.shard,
+                                   options.tag, options.flag, targets ? &*targets : nullptr, options.reference, 
+                                   compression_level, options.verbose, profile != nullptr, stats ? &*stats : nullptr);
+    } else if (stream_reads) {
+        // A read index is already loaded in no time, so there is no need to stream
+        if (options.verbose > 0) std::clog << "Streaming read names from sorted " << options.qname_tsv_path << std::endl;
+        SortedReadList reads {options.qname_tsv_path, value_tag, *qname_order};
+        const auto dst_bam = open_tag_output(output, *header, thread_pool, src_bam.get(), options.reference, index_on_write, options.output_format);
+        counts = tag_sorted_reads(src_bam.get(), header.get(), dst_bam.get(), reads, options.tag, options.flag, 
+                                  targets ? &*targets : nullptr, options.verbose, profile != nullptr, stats ? &*stats : nullptr);
+        save_index(dst_bam.get());
+    } else {
+        if (options.passthrough) {
+            counts = tag_reads_passthrough(src_bam_path, src_bam.get(), header.get(), output, *reads, *targets,
+                                           options.tag, options.flag, thread_pool, compression_level, 
+                                           options.verbose, profile != nullptr);
+        } else {
+            const auto dst_bam = open_tag_output(output, *header, thread_pool, src_bam.get(), options.reference, index_on_write, options.output_format);
+            counts = tag_reads(src_bam.get(), header.get(), dst_bam.get(), *reads, options.tag, options.flag, 
+                               targets ? &*targets : nullptr, &workers, options.verbose, profile != nullptr, stats ? &*stats : nullptr);
+            save_index(dst_bam.get());
+        }
+    }
+    if (!index_start) index_start = get_resource_usage();
+    if (options.build_index && output && !index_on_write
+     && sam_index_build3(output->c_str(), nullptr, 0, options.threads) < 0) {
+        std::clog << "Failed to build bam index for " << *output << std::endl;
+    }
+    if (profile) {
+        *profile = {src_bam_path, output, counts, *index_start - tag_start - load_wait, get_resource_usage() - *index_start};
+    }
+    if (stats) {
+        if (const auto stats_output = get_output_path(options.stats_output, src_bam_path)) {
+            std::ofstream file {*stats_output};
+            write(*stats, file);
+        } else {
+            write(*stats, std::cout);
+        }
+    }
+}
+
+void run_tag(const TagOptions& options)
+{
+    std::optional<StreamRelay> stdin_relay {}, stdout_relay {};
+    if (options.src_bam_paths.front() == "-") stdin_relay.emplace(StreamRelay::Stream::in);
+    if (!options.output && !options.hits) stdout_relay.emplace(StreamRelay::Stream::out);
+    const auto thread_pool = make_thread_pool(options.threads);
+    WorkerPool workers {options.threads > 1 ? static_cast<std::size_t>(options.threads) : 0};
+    // If no value is provided for the default tag then
+    // the input file contains values
+    std::optional<Tag::Name> value_tag {};
+    if (options.tag && std::holds_alternative<std::string_view>(options.tag->value)
+     && std::get<std::string_view>(options.tag->value).empty()) {
+        value_tag = options.tag->id;
+    }
+    // The read list is loaded on first use and shared by all inputs
+    const auto read_index = is_read_index(options.qname_tsv_path);
+    std::optional<TagProfile> profile {};
+    if (options.profile) {
+        profile.emplace();
+        profile->files.resize(options.src_bam_paths.size());
+    }
+    std::once_flag reads_loaded {};
+    std::optional<ReadList> reads {};
+    const auto get_reads = [&] () -> const ReadList& {
+        std::call_once(reads_loaded, [&] () {
+            const auto load_start = get_resource_usage();
+            if (read_index) {
+                reads = open_read_index(options.qname_tsv_path, value_tag, options.prefilter);
+            } else {
+                reads = load_reads(options.qname_tsv_path, value_tag, options.prefilter, &workers, options.verbose, options.partition);
+            }
+            if (options.verbose > 0) {
+                std::clog << "Loaded " << reads->names.size() << " read names (" 
+                          << memory_usage(*reads) / (1024 * 1024) << " MiB, load factor "
+                          << reads->names.load_factor() << ")" << std::endl;
+            }
+            if (profile) profile->load = get_resource_usage() - load_start;
+        });
+        return *reads;
+    };
+    const auto num_jobs = std::min(static_cast<std::size_t>(std::max(options.jobs, 1)), options.src_bam_paths.size());
+    std::atomic<std::size_t> next_file {0};
+    // The first error stops the other jobs and is rethrown once they finish
+    std::exception_ptr error {};
+    std::mutex error_mutex {};
+    const auto run_jobs = [&] () {
+        try {
+            for (auto i = next_file++; i < options.src_bam_paths.size(); i = next_file++) {
+                tag_file(options, options.src_bam_paths[i], value_tag, read_index, get_reads, thread_pool.get(), workers,
+                         profile ? &profile->files[i] : nullptr);
+            }
+        } catch (...) {
+            std::lock_guard lock {error_mutex};
+            if (!error) error = std::current_exception();
+            next_file = options.src_bam_paths.size();
+        }
+    };
+    std::vector<std::thread> jobs {};
+    for (std::size_t j {1}; j < num_jobs; ++j) jobs.emplace_back(run_jobs);
+    run_jobs();
+    for (auto& job : jobs) job.join();
+    if (error) std::rethrow_exception(error);
+    // Every file opened on a relay is closed by now
+    if (stdout_relay) stdout_relay->close();
+    if (stdin_relay) stdin_relay->close();
+    if (profile) {
+        std::ofstream file {*options.profile};
+        write_profile(*profile, options, reads ? &*reads : nullptr, file);
+        if (!file) throw_error("Failed to write profile to ", *options.profile);
+    }
+}
+
+} // namespace samtag::detail
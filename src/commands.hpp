@@ -0,0 +1,111 @@
+// Copyright (c) 2022 Daniel Cooke
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+// The commands of the samtag tool, which parses their options from the
+// command line and reports their errors. Internal, like engine.hpp, and built
+// as a static library of its own that the tool and the benchmarks link, so
+// libsamtag itself stays the embeddable API. Errors are thrown as
+// samtag::Error.
+
+#ifndef SAMTAG_COMMANDS_HPP
+#define SAMTAG_COMMANDS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+
+#include "engine.hpp"
+
+namespace samtag::detail {
+
+// Reference used to decode CRAM: a FASTA file, or the references already
+// loaded by another open CRAM file, which are then shared rather than reloaded.
+struct CramReference
+{
+    std::optional<fs::path> fasta {};
+    htsFile* shared = nullptr;
+};
+
+struct OutputFormat
+{
+    std::optional<std::string> format {}; // sam, bam or cram
+    std::optional<int> compression_level {};
+    bool uncompressed = false;
+};
+
+struct IndexReadsOptions
+{
+    fs::path qname_tsv_path;
+    std::optional<fs::path> output;
+    std::optional<Tag::Name> value_tag;
+    int threads = 1;
+    int verbose = 0;
+};
+
+struct MergeHitsOptions
+{
+    fs::path src_bam_path;
+    std::vector<fs::path> hits_paths;
+    std::optional<fs::path> output, reference;
+    OutputFormat output_format;
+    bool build_index = false;
+    int threads = 1;
+    int verbose = 0;
+};
+
+struct StatsOptions
+{
+    fs::path bam_path;
+    std::optional<fs::path> tag_path, bed_path, output, reference;
+    std::vector<SearchTag> tags;
+    std::optional<std::uint16_t> require_flags, exclude_flag;
+    std::optional<int> min_mapping_quality, min_length;
+    std::vector<std::string> contigs;
+    std::optional<std::size_t> top;
+    bool split = false, sort = false, distinct = false, proper_pair = false;
+    int threads = 1;
+    int verbose = 0;
+};
+
+struct TagOptions
+{
+    std::vector<fs::path> src_bam_paths;
+    fs::path qname_tsv_path;
+    std::optional<fs::path> output, bed_path, reference, stats_output, profile, hits;
+    std::vector<SearchTag> stats_tags;
+    bool split_stats = false;
+    OutputFormat output_format;
+    std::optional<Tag> tag;
+    std::optional<std::uint16_t> flag;
+    bool build_index = false, prefilter = false, name_sorted = false, passthrough = false;
+    std::size_t shards = 1;
+    std::optional<std::size_t> shard; // 0-based
+    std::optional<Partition> partition;
+    int threads = 1, jobs = 1;
+    int verbose = 0;
+};
+
+// Opens an input, "-" for stdin, and reads its header
+std::pair<std::unique_ptr<htsFile, HtsFileDeleter>, std::unique_ptr<bam_hdr_t, HtsHeaderDeleter>>
+open_bam(const fs::path& bam_path, hts_tpool* thread_pool = nullptr, const CramReference& reference = {});
+
+// The htslib mode for writing dst_bam_path, or stdout without a path
+std::string get_output_mode(const std::optional<fs::path>& dst_bam_path, const OutputFormat& output_format);
+
+TagStats init_stats(const StatsOptions& options);
+
+void run_tag(const TagOptions& options);
+void run_index_reads(const IndexReadsOptions& options);
+void run_merge_hits(const MergeHitsOptions& options);
+void run_stats(StatsOptions options);
+
+} // namespace samtag::detail
+
+#endif // SAMTAG_COMMANDS_HPP
@@ -0,0 +1,2020 @@
+// Copyright (c) 2022 Daniel Cooke
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+// The tagging and stats engine shared by libsamtag and the samtag tool. It
+// is internal (only samtag.hpp is installed) and header only, in
+// samtag::detail, so neither exports anything that could clash with the
+// program embedding the library.
+
+#ifndef SAMTAG_ENGINE_HPP
+#define SAMTAG_ENGINE_HPP
+
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <tuple>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <filesystem>
+#include <variant>
+#include <type_traits>
+#include <array>
+#include <regex>
+#include <functional>
+#include <cassert>
+#include <cmath>
+#include <span>
+#include <charconv>
+#include <bit>
+#include <cstring>
+#include <numeric>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <limits>
+#include <chrono>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+
+#include "samtag.hpp"
+
+namespace samtag::detail {
+
+namespace fs = std::filesystem;
+
+// Errors in anything reachable from the library API are thrown, and only
+// reported (and exit(1)) by the command line tool.
+template <typename... Args>
+[[noreturn]] void throw_error(const Args&... args)
+{
+    std::ostringstream message {};
+    (message << ... << args);
+    throw samtag::Error {message.str()};
+}
+
+struct HtsFileDeleter
+{
+    void operator()(htsFile* file) const { hts_close(file); }
+};
+struct HtsHeaderDeleter
+{
+    void operator()(bam_hdr_t* header) const { bam_hdr_destroy(header); }
+};
+struct HtsIndexDeleter
+{
+    void operator()(hts_idx_t* index) const { hts_idx_destroy(index); }
+};
+struct HtsIteratorDeleter
+{
+    void operator()(hts_itr_t* iterator) const { sam_itr_destroy(iterator); }
+};
+struct HtsBam1Deleter
+{
+    void operator()(bam1_t* b) const { bam_destroy1(b); }
+};
+struct HFileDeleter
+{
+    void operator()(hFILE* file) const { hclose(file); }
+};
+struct BgzfDeleter
+{
+    void operator()(BGZF* file) const { bgzf_close(file); }
+};
+struct HtsThreadPoolDeleter
+{
+    void operator()(hts_tpool* pool) const { hts_tpool_destroy(pool); }
+};
+
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(std::size_t capacity) : capacity_ {capacity} {}
+
+    void push(T value)
+    {
+        std::unique_lock lock {mutex_};
+        not_full_.wait(lock, [this] { return queue_.size() < capacity_; });
+        queue_.push_back(std::move(value));
+        not_empty_.notify_one();
+    }
+    std::optional<T> pop()
+    {
+        std::unique_lock lock {mutex_};
+        not_empty_.wait(lock, [this] { return !queue_.empty() || closed_; });
+        if (queue_.empty()) return std::nullopt;
+        T result {std::move(queue_.front())};
+        queue_.pop_front();
+        not_full_.notify_one();
+        return result;
+    }
+    void close()
+    {
+        std::lock_guard lock {mutex_};
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+private:
+    std::size_t capacity_;
+    std::deque<T> queue_ {};
+    bool closed_ = false;
+    std::mutex mutex_ {};
+    std::condition_variable not_empty_ {}, not_full_ {};
+};
+
+class WorkerPool
+{
+public:
+    explicit WorkerPool(std::size_t num_workers)
+    {
+        workers_.reserve(num_workers);
+        for (std::size_t i {0}; i < num_workers; ++i) {
+            workers_.emplace_back([this] () {
+                while (auto task = tasks_.pop()) (*task)();
+            });
+        }
+    }
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    ~WorkerPool()
+    {
+        tasks_.close();
+        for (auto& worker : workers_) worker.join();
+    }
+
+    auto size() const noexcept { return workers_.size(); }
+
+    template <typename F>
+    auto submit(F&& f)
+    {
+        using R = std::invoke_result_t<F>;
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+        auto result = task->get_future();
+        if (workers_.empty()) {
+            // A pool without workers runs tasks on the calling thread
+            (*task)();
+        } else {
+            tasks_.push([task = std::move(task)] () { (*task)(); });
+        }
+        return result;
+    }
+
+private:
+    BoundedQueue<std::function<void()>> tasks_ {std::numeric_limits<std::size_t>::max()};
+    std::vector<std::thread> workers_ {};
+};
+
+// Read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+    explicit MappedFile(const fs::path& path)
+    {
+        const int fd {::open(path.c_str(), O_RDONLY)};
+        struct stat info {};
+        if (fd < 0 || ::fstat(fd, &info) < 0) {
+            if (fd >= 0) ::close(fd);
+            throw_error("Failed to open ", path);
+        }
+        size_ = static_cast<std::size_t>(info.st_size);
+        if (size_ > 0) {
+            data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data_ == MAP_FAILED) {
+                ::close(fd);
+                throw_error("Failed to map ", path);
+            }
+        }
+        ::close(fd);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile()
+    {
+        if (data_) ::munmap(data_, size_);
+    }
+
+    std::string_view data() const noexcept
+    {
+        return {static_cast<const char*>(data_), size_};
+    }
+
+private:
+    void* data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+struct StringHash
+{
+    using is_transparent = void;
+    auto operator()(const std::string_view str) const noexcept { return std::hash<std::string_view> {}(str); }
+};
+
+//
+// regions
+//
+
+// Non-overlapping sorted intervals indexed by tid.
+struct TargetRegions
+{
+    std::vector<std::vector<hts_pair_pos_t>> intervals;
+};
+
+// Parses the BED file in place from a mapping. Intervals on contigs missing
+// from the header are dropped with a warning.
+inline auto read_bed_regions(const fs::path& bed_path, const bam_hdr_t& header)
+{
+    TargetRegions result {};
+    result.intervals.resize(static_cast<std::size_t>(header.n_targets));
+    std::unordered_map<std::string_view, int, StringHash, std::equal_to<>> tids {};
+    tids.reserve(static_cast<std::size_t>(header.n_targets));
+    for (int tid {0}; tid < header.n_targets; ++tid) tids.emplace(header.target_name[tid], tid);
+    std::unordered_map<std::string, std::size_t, StringHash, std::equal_to<>> dropped {};
+    const MappedFile bed {bed_path};
+    const auto text = bed.data();
+    const auto malformed = [&] (const std::size_t line_number) {
+        throw_error("ERROR: malformed bed file ", bed_path, " at line ", line_number);
+    };
+    // Parses a position field ending in a tab or the end of the line
+    const auto parse_position = [] (const char* first, const char* last, hts_pos_t& value) {
+        const auto [ptr, ec] = std::from_chars(first, last, value);
+        return ec == std::errc {} && (ptr == last || *ptr == '\t') ? ptr : nullptr;
+    };
+    // BED files are usually grouped by contig, so the tid is only looked up when it changes
+    std::string_view contig {};
+    int tid {-1};
+    std::size_t line_number {0};
+    for (std::size_t pos {0}; pos < text.size();) {
+        const auto end = std::min(text.find('\n', pos), text.size());
+        auto line = text.substr(pos, end - pos);
+        pos = end + 1;
+        ++line_number;
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (line.empty() || line.front() == '#' || line.starts_with("track") || line.starts_with("browser")) continue;
+        const auto contig_end = line.find('\t');
+        if (contig_end == std::string_view::npos) malformed(line_number);
+        const auto last = line.data() + line.size();
+        hts_pair_pos_t interval {};
+        const auto begin_end = parse_position(line.data() + contig_end + 1, last, interval.beg);
+        if (!begin_end || begin_end == last) malformed(line_number);
+        const auto end_end = parse_position(begin_end + 1, last, interval.end);
+        if (!end_end || interval.end < interval.beg) malformed(line_number);
+        if (line.substr(0, contig_end) != contig) {
+            contig = line.substr(0, contig_end);
+            const auto itr = tids.find(contig);
+            tid = itr != std::cend(tids) ? itr->second : -1;
+        }
+        if (tid >= 0) {
+            result.intervals[static_cast<std::size_t>(tid)].push_back(interval);
+        } else if (const auto itr = dropped.find(contig); itr != std::end(dropped)) {
+            ++itr->second;
+        } else {
+            dropped.emplace(contig, 1);
+        }
+    }
+    if (!dropped.empty()) {
+        const auto num_dropped = std::accumulate(std::cbegin(dropped), std::cend(dropped), std::size_t {0}, 
+                                                 [] (const auto total, const auto& contig) { return total + contig.second; });
+        std::clog << "WARN: dropped " << num_dropped << " intervals in " << bed_path << " on " << dropped.size() 
+                  << " contigs not in the header (e.g. " << std::cbegin(dropped)->first << ")" << std::endl;
+    }
+    return result;
+}
+
+inline auto merge(const std::vector<hts_pair_pos_t>& intervals)
+{
+    std::vector<hts_pair_pos_t> result {};
+    if (intervals.empty()) return result;
+    result.reserve(intervals.size());
+    auto current = std::cbegin(intervals);
+    auto overlapped = current;
+    auto rightmost = current;
+    for (const auto last = std::cend(intervals); current != last; ++current) {
+        if (current->beg > rightmost->end) {
+            if (result.empty() || result.back().end != rightmost->end) {
+                result.push_back({overlapped->beg, rightmost->end});
+            }
+            rightmost = current;
+            overlapped = current;
+        } else if (current->end >= rightmost->end) {
+            rightmost = current;
+        }
+    }
+    result.push_back({overlapped->beg, rightmost->end});
+    return result;
+}
+
+inline auto get_target_regions(const fs::path& bed_path, const bam_hdr_t& header)
+{
+    auto result = read_bed_regions(bed_path, header);
+    for (auto& intervals : result.intervals) {
+        std::sort(std::begin(intervals), std::end(intervals), [] (const auto& lhs, const auto& rhs) {
+            return std::tie(lhs.beg, lhs.end) < std::tie(rhs.beg, rhs.end);
+        });
+        intervals = merge(intervals);
+    }
+    return result;
+}
+
+struct IntervalStats
+{
+    std::size_t num_contigs, num_targets, num_bases;
+};
+
+inline auto length(const hts_pair_pos_t& interval) noexcept
+{
+    return interval.end - interval.beg;
+}
+
+inline auto calculate_interval_stats(const TargetRegions& targets)
+{
+    IntervalStats result {};
+    for (const auto& intervals : targets.intervals) {
+        if (intervals.empty()) continue;
+        ++result.num_contigs;
+        for (const auto& interval : intervals) {
+            ++result.num_targets;
+            result.num_bases += length(interval);
+        }
+    }
+    return result;
+}
+
+inline bool overlaps(const bam1_t& read, const TargetRegions& targets)
+{
+    if (read.core.tid < 0 || read.core.tid >= static_cast<int>(targets.intervals.size())) return false;
+    const auto& intervals = targets.intervals[read.core.tid];
+    const auto itr = std::upper_bound(std::cbegin(intervals), std::cend(intervals), read.core.pos, 
+        [] (const hts_pos_t pos, const hts_pair_pos_t& interval) { return pos < interval.end; });
+    return itr != std::cend(intervals) && itr->beg < bam_endpos(&read);
+}
+
+// All intervals may have been dropped, and iterators need at least one
+inline bool has_intervals(const TargetRegions& targets) noexcept
+{
+    return std::any_of(std::cbegin(targets.intervals), std::cend(targets.intervals), [] (const auto& intervals) { return !intervals.empty(); });
+}
+
+//
+// tag
+//
+
+struct Tag
+{
+    using Name = std::array<char, 2>;
+    using Value = std::variant<std::string_view, long, float>;
+    Name id;
+    Value value;
+};
+
+inline Tag::Value get_tag_value(const std::string_view value)
+{
+    const auto first = value.data(), last = value.data() + value.size();
+    if (value.find('.') == std::string::npos) {
+        long result;
+        const auto [ptr, ec] = std::from_chars(first, last, result);
+        if (ec == std::errc {} && ptr == last) return result;
+    } else {
+        float result;
+        const auto [ptr, ec] = std::from_chars(first, last, result);
+        if (ec == std::errc {} && ptr == last) return result;
+    }
+    return value;
+}
+
+inline bool is_valid_tag(const std::string_view tag) noexcept
+{
+    return !(tag.size() < 2 || tag.size() == 3 || (tag.size() > 3 && tag[2] != ':'));
+}
+
+inline Tag parse_tag(const std::string_view tag)
+{
+    assert(is_valid_tag(tag));
+    Tag result {};
+    std::copy_n(std::cbegin(tag), 2, std::begin(result.id));
+    if (tag.size() > 3) {
+        result.value = get_tag_value(tag.substr(3));
+    }
+    return result;
+}
+
+inline auto get_tag(const std::string_view& tag)
+{
+    if (!is_valid_tag(tag)) throw_error("Invalid tag ", tag, " (required TAG:VALUE)");
+    return parse_tag(tag);
+}
+
+// A pre-typed tag stored in a ReadList. String values are kept in the
+// list's string arena so the hot loop never parses or allocates. It is
+// written to read index and hit list files as is, so has no padding.
+struct EditTag
+{
+    Tag::Name id;
+    char type; // 'i', 'f' or 'Z'
+    char reserved;
+    std::uint32_t length; // of string value
+    std::uint64_t value; // integer, float bits, or string arena offset
+};
+
+struct ReadEdits
+{
+    std::uint32_t tags_begin;
+    std::uint16_t num_tags, flag;
+};
+
+inline std::uint64_t hash_read_name(const std::string_view name) noexcept
+{
+    constexpr std::uint64_t multiplier {0x9e3779b97f4a7c15ull};
+    const auto mix = [&] (std::uint64_t h, const std::uint64_t word) noexcept {
+        h = (h ^ word) * multiplier;
+        return h ^ (h >> 32);
+    };
+    std::uint64_t result {name.size() * multiplier};
+    std::size_t i {0};
+    for (; i + 8 <= name.size(); i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, name.data() + i, 8);
+        result = mix(result, word);
+    }
+    if (i < name.size()) {
+        std::uint64_t word {0};
+        std::memcpy(&word, name.data() + i, name.size() - i);
+        result = mix(result, word);
+    }
+    result ^= result >> 33;
+    result *= 0xff51afd7ed558ccdull;
+    result ^= result >> 33;
+    result *= 0xc4ceb9fe1a85ec53ull;
+    return result ^ (result >> 33);
+}
+
+// Maps read names to ReadEdits. Names are stored length-prefixed in a single
+// arena and looked up through an open-addressing table of entry indices, so
+// each name costs its length plus ~28 bytes rather than two heap allocations
+// and a map node. The arrays are either owned or views of a mapped read index
+// (see index-reads), which cannot be modified.
+class ReadNameIndex
+{
+public:
+    // The upper half of each slot holds the upper half of the name hash so
+    // most mismatches are rejected without touching the arena.
+    using Slot = std::uint64_t;
+    struct Entry
+    {
+        std::uint64_t name_offset;
+        ReadEdits edits;
+    };
+    
+    ReadNameIndex() = default;
+    ReadNameIndex(const ReadNameIndex&) = delete;
+    ReadNameIndex& operator=(const ReadNameIndex&) = delete;
+    ReadNameIndex(ReadNameIndex&&) = default;
+    ReadNameIndex& operator=(ReadNameIndex&&) = default;
+    ReadNameIndex(std::span<const char> names, std::span<const Entry> entries, std::span<const Slot> slots) noexcept
+    : names_view_ {names}
+    , entries_view_ {entries}
+    , slots_view_ {slots}
+    {}
+
+    void reserve(const std::size_t num_names)
+    {
+        entries_.reserve(num_names);
+        if (num_names > max_load(slots_.size())) rehash(num_names);
+        update_views();
+    }
+    std::pair<ReadEdits*, bool> try_emplace(const std::string_view name)
+    {
+        return try_emplace(name, hash_read_name(name));
+    }
+    std::pair<ReadEdits*, bool> try_emplace(const std::string_view name, const std::uint64_t hash)
+    {
+        assert(name.size() <= std::numeric_limits<std::uint8_t>::max());
+        assert(hash == hash_read_name(name));
+        assert(entries_view_.data() == entries_.data());
+        if (entries_.size() + 1 > max_load(slots_.size())) rehash(entries_.size() + 1);
+        auto slot = probe(name, hash);
+        if (slots_[slot] != 0) {
+            return {&entries_[(slots_[slot] & entry_mask) - 1].edits, false};
+        }
+        if (entries_.size() >= entry_mask) throw_error("Too many read names");
+        entries_.push_back({names_.size(), {}});
+        names_.push_back(static_cast<char>(name.size()));
+        names_.insert(std::end(names_), std::cbegin(name), std::cend(name));
+        slots_[slot] = (hash & ~entry_mask) | entries_.size();
+        update_views();
+        return {&entries_.back().edits, true};
+    }
+    const ReadEdits* find(const std::string_view name) const noexcept
+    {
+        return find(name, hash_read_name(name));
+    }
+    const ReadEdits* find(const std::string_view name, const std::uint64_t hash) const noexcept
+    {
+        if (slots_view_.empty()) return nullptr;
+        const auto slot = slots_view_[probe(name, hash)];
+        return slot != 0 ? &entries_view_[(slot & entry_mask) - 1].edits : nullptr;
+    }
+    // Prefetch the first slot probed for hash, and then the entry it points
+    // to, so a batch of lookups can overlap their cache misses.
+    void prefetch_slot(const std::uint64_t hash) const noexcept
+    {
+        if (!slots_view_.empty()) __builtin_prefetch(&slots_view_[hash & (slots_view_.size() - 1)]);
+    }
+    void prefetch_entry(const std::uint64_t hash) const noexcept
+    {
+        if (slots_view_.empty()) return;
+        const auto slot = slots_view_[hash & (slots_view_.size() - 1)];
+        if (slot != 0 && (slot & ~entry_mask) == (hash & ~entry_mask)) {
+            __builtin_prefetch(&entries_view_[(slot & entry_mask) - 1]);
+        }
+    }
+    std::size_t size() const noexcept { return entries_view_.size(); }
+    std::size_t memory_usage() const noexcept
+    {
+        return names_view_.size() + entries_view_.size_bytes() + slots_view_.size_bytes();
+    }
+    double load_factor() const noexcept
+    {
+        return slots_view_.empty() ? 0 : static_cast<double>(entries_view_.size()) / slots_view_.size();
+    }
+    std::span<const char> names() const noexcept { return names_view_; }
+    std::span<const Entry> entries() const noexcept { return entries_view_; }
+    std::span<const Slot> slots() const noexcept { return slots_view_; }
+
+private:
+    constexpr static Slot entry_mask {0xffffffffull};
+
+    std::vector<char> names_ {};
+    std::vector<Entry> entries_ {};
+    std::vector<Slot> slots_ {};
+    std::span<const char> names_view_ {};
+    std::span<const Entry> entries_view_ {};
+    std::span<const Slot> slots_view_ {};
+
+    static std::size_t max_load(const std::size_t num_slots) noexcept { return num_slots - num_slots / 4; }
+
+    void update_views() noexcept
+    {
+        names_view_ = names_;
+        entries_view_ = entries_;
+        slots_view_ = slots_;
+    }
+    std::string_view name(const Entry& entry) const noexcept
+    {
+        const auto length = static_cast<std::uint8_t>(names_view_[entry.name_offset]);
+        return {names_view_.data() + entry.name_offset + 1, length};
+    }
+    std::size_t probe(const std::string_view name, const std::uint64_t hash) const noexcept
+    {
+        const auto mask = slots_view_.size() - 1;
+        for (auto slot = hash & mask;; slot = (slot + 1) & mask) {
+            const auto s = slots_view_[slot];
+            if (s == 0) return slot;
+            if ((s & ~entry_mask) == (hash & ~entry_mask) && this->name(entries_view_[(s & entry_mask) - 1]) == name) {
+                return slot;
+            }
+        }
+    }
+    void rehash(const std::size_t num_names)
+    {
+        std::size_t num_slots {16};
+        while (max_load(num_slots) < num_names) num_slots *= 2;
+        slots_.assign(num_slots, 0);
+        update_views();
+        const auto mask = num_slots - 1;
+        for (std::size_t i {0}; i < entries_.size(); ++i) {
+            const auto hash = hash_read_name(name(entries_[i]));
+            auto slot = hash & mask;
+            while (slots_[slot] != 0) slot = (slot + 1) & mask;
+            slots_[slot] = (hash & ~entry_mask) | (i + 1);
+        }
+    }
+};
+
+// Blocked Bloom filter over read name hashes. All probes for a name hit a
+// single cache line, so most unlisted reads are rejected with one access to
+// a structure much smaller than ReadNameIndex.
+class ReadNameFilter
+{
+public:
+    constexpr static unsigned block_bits {512};
+    struct alignas(64) Block
+    {
+        std::array<std::uint64_t, block_bits / 64> words;
+    };
+    
+    ReadNameFilter() = default;
+    explicit ReadNameFilter(const std::size_t num_names, const std::size_t bits_per_name = 10)
+    : blocks_(std::max((num_names * bits_per_name + block_bits - 1) / block_bits, std::size_t {1}))
+    , blocks_view_ {blocks_}
+    {}
+    explicit ReadNameFilter(std::span<const Block> blocks) noexcept : blocks_view_ {blocks} {}
+    ReadNameFilter(const ReadNameFilter&) = delete;
+    ReadNameFilter& operator=(const ReadNameFilter&) = delete;
+    ReadNameFilter(ReadNameFilter&&) = default;
+    ReadNameFilter& operator=(ReadNameFilter&&) = default;
+
+    void insert(const std::uint64_t hash) noexcept
+    {
+        assert(blocks_view_.data() == blocks_.data());
+        auto& block = blocks_[block_index(hash)];
+        for_each_bit(hash, [&] (const unsigned bit) { block.words[bit / 64] |= std::uint64_t {1} << (bit % 64); return true; });
+    }
+    bool may_contain(const std::uint64_t hash) const noexcept
+    {
+        const auto& block = blocks_view_[block_index(hash)];
+        return for_each_bit(hash, [&] (const unsigned bit) { return (block.words[bit / 64] >> (bit % 64)) & 1; });
+    }
+    void prefetch(const std::uint64_t hash) const noexcept
+    {
+        __builtin_prefetch(&blocks_view_[block_index(hash)]);
+    }
+    std::size_t memory_usage() const noexcept { return blocks_view_.size_bytes(); }
+    std::span<const Block> blocks() const noexcept { return blocks_view_; }
+
+private:
+    constexpr static unsigned num_probes {6};
+
+    std::vector<Block> blocks_ {};
+    std::span<const Block> blocks_view_ {};
+
+    std::size_t block_index(const std::uint64_t hash) const noexcept
+    {
+        return static_cast<std::size_t>(((hash >> 32) * blocks_view_.size()) >> 32);
+    }
+    template <typename F>
+    static bool for_each_bit(const std::uint64_t hash, F f) noexcept
+    {
+        const auto bits = hash * 0x9e3779b97f4a7c15ull;
+        for (unsigned i {0}; i < num_probes; ++i) {
+            if (!f(static_cast<unsigned>(bits >> (10 + 9 * i)) % block_bits)) return false;
+        }
+        return true;
+    }
+};
+
+struct ReadList
+{
+    ReadNameIndex names;
+    std::vector<EditTag> tags;
+    std::vector<char> strings;
+    std::optional<ReadNameFilter> filter;
+    // Set when loaded from an index-reads file, which then backs names,
+    // filter and the mapped tags and strings (the vectors are unused).
+    std::shared_ptr<const MappedFile> index_file {};
+    std::span<const EditTag> mapped_tags {};
+    std::span<const char> mapped_strings {};
+};
+
+inline std::span<const EditTag> edit_tags(const ReadList& reads) noexcept
+{
+    return reads.index_file ? reads.mapped_tags : std::span<const EditTag> {reads.tags};
+}
+
+inline std::span<const char> edit_strings(const ReadList& reads) noexcept
+{
+    return reads.index_file ? reads.mapped_strings : std::span<const char> {reads.strings};
+}
+
+inline auto memory_usage(const ReadList& reads) noexcept
+{
+    return reads.names.memory_usage() + edit_tags(reads).size_bytes() + edit_strings(reads).size()
+        + (reads.filter ? reads.filter->memory_usage() : 0);
+}
+
+// One of count partitions of the read names by hash, for --partition
+struct Partition
+{
+    std::size_t index, count;
+    
+    bool contains(const std::uint64_t hash) const noexcept
+    {
+        // Remixed, as the low bits of the hash pick the index slot
+        return (((hash * 0xff51afd7ed558ccdull) >> 32) * count >> 32) == index;
+    }
+};
+
+// Parses INT1/INT2 with 1 <= INT1 <= INT2 as a 0-based part of INT2
+inline std::optional<std::pair<std::size_t, std::size_t>> parse_part(const std::string_view arg) noexcept
+{
+    const auto slash = arg.find('/');
+    if (slash == std::string_view::npos) return std::nullopt;
+    std::size_t part {0}, count {0};
+    const auto [part_end, part_ec] = std::from_chars(arg.data(), arg.data() + slash, part);
+    const auto [count_end, count_ec] = std::from_chars(arg.data() + slash + 1, arg.data() + arg.size(), count);
+    if (part_ec != std::errc {} || part_end != arg.data() + slash || count_ec != std::errc {} 
+     || count_end != arg.data() + arg.size() || part < 1 || part > count) {
+        return std::nullopt;
+    }
+    return std::make_pair(part - 1, count);
+}
+
+inline auto get_tag(const EditTag& tag, const std::span<const char> strings) noexcept
+{
+    Tag result {tag.id, {}};
+    switch (tag.type) {
+    case 'i': result.value = std::bit_cast<long>(tag.value); break;
+    case 'f': result.value = std::bit_cast<float>(static_cast<std::uint32_t>(tag.value)); break;
+    default: result.value = std::string_view {strings.data() + tag.value, tag.length};
+    }
+    return result;
+}
+
+inline void add_edit_tag(const Tag& tag, std::vector<EditTag>& tags, std::vector<char>& strings)
+{
+    EditTag result {tag.id, 'Z', 0, 0, 0};
+    std::visit([&] (auto&& value) {
+        using T = std::remove_cv_t<std::decay_t<decltype(value)>>;
+        if constexpr (std::is_same_v<T, long>) {
+            result.type = 'i';
+            result.value = std::bit_cast<std::uint64_t>(value);
+        } else if constexpr (std::is_same_v<T, float>) {
+            result.type = 'f';
+            result.value = std::bit_cast<std::uint32_t>(value);
+        } else {
+            result.length = static_cast<std::uint32_t>(value.size());
+            result.value = strings.size();
+            strings.insert(std::end(strings), std::cbegin(value), std::cend(value));
+        }
+    }, tag.value);
+    tags.push_back(result);
+}
+
+// Parses the columns following the read name: TAGS[\tFLAG], where TAGS are
+// separated with ';'. If value_tag is set then the first tag is a bare value
+// for value_tag.
+inline std::optional<ReadEdits>
+parse_edits(const std::string_view edits,
+            const std::optional<Tag::Name>& value_tag,
+            std::vector<EditTag>& tags,
+            std::vector<char>& strings)
+{
+    ReadEdits result {static_cast<std::uint32_t>(tags.size()), 0, 0};
+    auto read_tags = edits;
+    if (const auto tags_end = edits.find('\t'); tags_end != std::string_view::npos) {
+        const auto flag = edits.substr(tags_end + 1);
+        const auto [ptr, ec] = std::from_chars(flag.data(), flag.data() + flag.size(), result.flag);
+        if (ec != std::errc {} || ptr != flag.data() + flag.size()) return std::nullopt;
+        read_tags = edits.substr(0, tags_end);
+    }
+    for (bool first {true}; !read_tags.empty(); first = false) {
+        const auto tag_end = std::min(read_tags.find(';'), read_tags.size());
+        const auto tag = read_tags.substr(0, tag_end);
+        if (first && value_tag) {
+            add_edit_tag({*value_tag, get_tag_value(tag)}, tags, strings);
+        } else if (is_valid_tag(tag)) {
+            add_edit_tag(parse_tag(tag), tags, strings);
+        } else {
+            tags.resize(result.tags_begin);
+            return std::nullopt;
+        }
+        read_tags.remove_prefix(std::min(tag_end + 1, read_tags.size()));
+    }
+    const auto num_tags = tags.size() - result.tags_begin;
+    if (tags.size() > std::numeric_limits<std::uint32_t>::max() || num_tags > std::numeric_limits<std::uint16_t>::max()) {
+        return std::nullopt;
+    }
+    result.num_tags = static_cast<std::uint16_t>(num_tags);
+    return result;
+}
+
+// Splits text into about num_chunks chunks ending on line boundaries.
+inline auto split_lines(const std::string_view text, const std::size_t num_chunks)
+{
+    std::vector<std::string_view> result {};
+    const auto chunk_size = std::max(text.size() / std::max(num_chunks, std::size_t {1}), std::size_t {1});
+    for (std::size_t begin {0}; begin < text.size();) {
+        auto end = text.find('\n', std::min(begin + chunk_size, text.size()) - 1);
+        end = end == std::string_view::npos ? text.size() : end + 1;
+        result.push_back(text.substr(begin, end - begin));
+        begin = end;
+    }
+    return result;
+}
+
+struct ReadChunk
+{
+    struct Read
+    {
+        std::string_view name;
+        std::uint64_t hash;
+        ReadEdits edits;
+    };
+    std::vector<Read> reads;
+    std::vector<EditTag> tags;
+    std::vector<char> strings;
+    std::size_t num_lines;
+    std::optional<std::pair<std::size_t, std::string_view>> invalid_line;
+};
+
+// Removes and returns the first line of text, without any line terminator.
+inline std::string_view pop_line(std::string_view& text) noexcept
+{
+    const auto line_end = std::min(text.find('\n'), text.size());
+    auto result = text.substr(0, line_end);
+    text.remove_prefix(std::min(line_end + 1, text.size()));
+    if (!result.empty() && result.back() == '\r') result.remove_suffix(1);
+    return result;
+}
+
+// Splits a qname TSV line into the read name and its edits.
+inline auto split_read_line(const std::string_view line) noexcept
+{
+    const auto name_end_pos = std::min(line.find('\t'), line.size());
+    return std::make_pair(line.substr(0, name_end_pos), line.substr(std::min(name_end_pos + 1, line.size())));
+}
+
+inline auto parse_reads(std::string_view text, const std::optional<Tag::Name>& value_tag, const std::size_t num_lines)
+{
+    ReadChunk result {};
+    result.reads.reserve(num_lines);
+    for (; !text.empty(); ++result.num_lines) {
+        const auto line = pop_line(text);
+        if (line.empty()) continue;
+        const auto [name, read_edits] = split_read_line(line);
+        const auto edits = parse_edits(read_edits, value_tag, result.tags, result.strings);
+        if (!edits || name.size() > std::numeric_limits<std::uint8_t>::max()) {
+            result.invalid_line = {result.num_lines, line};
+            break;
+        }
+        result.reads.push_back({name, hash_read_name(name), *edits});
+    }
+    return result;
+}
+
+inline auto load_reads(const fs::path& qnames_tsv_path, 
+                const std::optional<Tag::Name>& value_tag = std::nullopt, 
+                const bool build_filter = false,
+                WorkerPool* workers = nullptr,
+                const bool verbose = false,
+                const std::optional<Partition>& partition = std::nullopt)
+{
+    const std::size_t log_tick {10'000'000};
+    WorkerPool caller {0};
+    if (!workers) workers = &caller;
+    const MappedFile qname_tsv {qnames_tsv_path};
+    const auto num_workers = std::max(workers ? workers->size() : 0, std::size_t {1});
+    // Small chunks keep the number of parsed but unmerged reads bounded
+    const auto chunks = split_lines(qname_tsv.data(), std::max(num_workers * 16, qname_tsv.data().size() >> 25));
+    std::vector<std::future<std::size_t>> line_counts {};
+    line_counts.reserve(chunks.size());
+    for (const auto& chunk : chunks) {
+        line_counts.push_back(workers->submit([chunk] () {
+            return static_cast<std::size_t>(std::count(std::cbegin(chunk), std::cend(chunk), '\n') + (chunk.back() != '\n'));
+        }));
+    }
+    std::vector<std::size_t> chunk_lines(chunks.size());
+    std::transform(std::begin(line_counts), std::end(line_counts), std::begin(chunk_lines), [] (auto& count) { return count.get(); });
+    ReadList result {};
+    const auto num_lines = std::reduce(std::cbegin(chunk_lines), std::cend(chunk_lines)) / (partition ? partition->count : 1);
+    result.names.reserve(num_lines);
+    if (build_filter) result.filter.emplace(num_lines);
+    std::deque<std::future<ReadChunk>> parsed_chunks {};
+    std::size_t next_chunk {0}, line_offset {0};
+    const auto submit_chunk = [&] () {
+        parsed_chunks.push_back(workers->submit([&, i = next_chunk] () {
+            return parse_reads(chunks[i], value_tag, chunk_lines[i]);
+        }));
+        ++next_chunk;
+    };
+    while (next_chunk < chunks.size() && parsed_chunks.size() < 2 * num_workers) submit_chunk();
+    while (!parsed_chunks.empty()) {
+        auto chunk = parsed_chunks.front().get();
+        parsed_chunks.pop_front();
+        if (next_chunk < chunks.size()) submit_chunk();
+        if (chunk.invalid_line) {
+            // Tasks still queued refer to chunks, so they must finish first
+            for (auto& parsed_chunk : parsed_chunks) parsed_chunk.wait();
+            throw_error("Invalid line ", line_offset + chunk.invalid_line->first + 1, " of ",
+                        qnames_tsv_path, ": ", chunk.invalid_line->second);
+        }
+        // Without a partition every read is normally kept, so the strings
+        // are copied in one go; otherwise only those of the kept reads
+        const auto strings_offset = result.strings.size();
+        if (!partition) {
+            result.strings.insert(std::end(result.strings), std::cbegin(chunk.strings), std::cend(chunk.strings));
+        }
+        for (const auto& read : chunk.reads) {
+            if (partition && !partition->contains(read.hash)) continue;
+            auto [read_edits, inserted] = result.names.try_emplace(read.name, read.hash);
+            if (!inserted) continue;
+            if (result.filter) result.filter->insert(read.hash);
+            *read_edits = read.edits;
+            read_edits->tags_begin = static_cast<std::uint32_t>(result.tags.size());
+            const auto tags_begin = std::next(std::cbegin(chunk.tags), read.edits.tags_begin);
+            std::transform(tags_begin, std::next(tags_begin, read.edits.num_tags), std::back_inserter(result.tags), [&] (EditTag tag) {
+                if (tag.type != 'Z') return tag;
+                if (partition) {
+                    const auto value = std::next(std::cbegin(chunk.strings), static_cast<std::ptrdiff_t>(tag.value));
+                    tag.value = result.strings.size();
+                    result.strings.insert(std::end(result.strings), value, std::next(value, tag.length));
+                } else {
+                    tag.value += strings_offset;
+                }
+                return tag;
+            });
+            if (result.tags.size() > std::numeric_limits<std::uint32_t>::max()) {
+                for (auto& parsed_chunk : parsed_chunks) parsed_chunk.wait();
+                throw_error("Too many tags in ", qnames_tsv_path);
+            }
+        }
+        if (verbose && (line_offset + chunk.num_lines) / log_tick > line_offset / log_tick) {
+            std::clog << "Loaded " << result.names.size() << " reads" << std::endl;
+        }
+        line_offset += chunk.num_lines;
+    }
+    return result;
+}
+
+// Binary read list written by index-reads. The sections follow the header in
+// the order of the counts below, each at a 64 byte aligned offset, and are
+// used in place from a read-only mapping.
+struct ReadIndexHeader
+{
+    std::array<char, 8> magic;
+    std::uint32_t version;
+    Tag::Name value_tag; // zeros if none
+    std::uint16_t reserved;
+    std::uint64_t num_slots, num_entries, num_tags, num_filter_blocks, names_size, strings_size;
+};
+
+constexpr std::array<char, 8> read_index_magic {'S', 'A', 'M', 'T', 'A', 'G', 'R', 'I'};
+constexpr std::uint32_t read_index_version {1};
+constexpr std::size_t read_index_alignment {64};
+
+static_assert(std::is_trivially_copyable_v<ReadIndexHeader> && std::is_trivially_copyable_v<ReadNameIndex::Entry>
+           && std::is_trivially_copyable_v<EditTag> && std::is_trivially_copyable_v<ReadNameFilter::Block>);
+static_assert(std::has_unique_object_representations_v<ReadIndexHeader> && std::has_unique_object_representations_v<ReadNameIndex::Entry>
+           && std::has_unique_object_representations_v<EditTag>);
+
+inline bool is_read_index(const fs::path& path)
+{
+    std::ifstream file {path, std::ios::binary};
+    std::array<char, 8> magic {};
+    file.read(magic.data(), magic.size());
+    return file && magic == read_index_magic;
+}
+
+inline void write_read_index(const ReadList& reads, const std::optional<Tag::Name>& value_tag, const fs::path& path)
+{
+    assert(reads.filter);
+    ReadIndexHeader header {read_index_magic, read_index_version, value_tag.value_or(Tag::Name {}), 0,
+                            reads.names.slots().size(), reads.names.entries().size(), edit_tags(reads).size(),
+                            reads.filter->blocks().size(), reads.names.names().size(), edit_strings(reads).size()};
+    std::ofstream file {path, std::ios::binary};
+    std::size_t offset {0};
+    const auto write_section = [&] (const auto section) {
+        const std::array<char, read_index_alignment> padding {};
+        file.write(padding.data(), static_cast<std::streamsize>((read_index_alignment - offset % read_index_alignment) % read_index_alignment));
+        offset += (read_index_alignment - offset % read_index_alignment) % read_index_alignment;
+        file.write(reinterpret_cast<const char*>(section.data()), static_cast<std::streamsize>(section.size_bytes()));
+        offset += section.size_bytes();
+    };
+    write_section(std::span<const ReadIndexHeader> {&header, 1});
+    write_section(reads.names.slots());
+    write_section(reads.names.entries());
+    write_section(edit_tags(reads));
+    write_section(reads.filter->blocks());
+    write_section(reads.names.names());
+    write_section(edit_strings(reads));
+    if (!file.flush()) throw_error("Failed to write ", path);
+}
+
+inline ReadList 
+open_read_index(const fs::path& path, 
+                const std::optional<Tag::Name>& value_tag = std::nullopt,
+                const bool use_filter = false)
+{
+    ReadList result {};
+    result.index_file = std::make_shared<const MappedFile>(path);
+    const auto data = result.index_file->data();
+    const auto fail = [&] (const auto& reason) { throw_error("Invalid read index ", path, ": ", reason); };
+    ReadIndexHeader header {};
+    if (data.size() < sizeof(header)) fail("truncated");
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != read_index_magic) fail("not a read index");
+    if (header.version != read_index_version) fail("unsupported version");
+    if (header.value_tag != value_tag.value_or(Tag::Name {})) {
+        fail(value_tag ? "not built with the same --tag" : "built with --tag, which is then required");
+    }
+    if (header.num_slots & (header.num_slots - 1)) fail("bad slot count");
+    std::size_t offset {sizeof(header)};
+    const auto next_section = [&] <typename T> (const std::uint64_t count) {
+        offset += (read_index_alignment - offset % read_index_alignment) % read_index_alignment;
+        if (offset > data.size() || count > (data.size() - offset) / sizeof(T)) fail("truncated");
+        const std::span<const T> section {reinterpret_cast<const T*>(data.data() + offset), static_cast<std::size_t>(count)};
+        offset += section.size_bytes();
+        return section;
+    };
+    const auto slots = next_section.operator()<ReadNameIndex::Slot>(header.num_slots);
+    const auto entries = next_section.operator()<ReadNameIndex::Entry>(header.num_entries);
+    result.mapped_tags = next_section.operator()<EditTag>(header.num_tags);
+    const auto filter_blocks = next_section.operator()<ReadNameFilter::Block>(header.num_filter_blocks);
+    const auto names = next_section.operator()<char>(header.names_size);
+    result.mapped_strings = next_section.operator()<char>(header.strings_size);
+    result.names = ReadNameIndex {names, entries, slots};
+    if (use_filter) {
+        if (filter_blocks.empty()) fail("no prefilter");
+        result.filter.emplace(filter_blocks);
+    }
+    return result;
+}
+
+template<class> inline constexpr bool always_false_v = false;
+
+// Size of the aux field starting at type, or 0 if it overruns end.
+inline std::size_t aux_size(const std::uint8_t* type, const std::uint8_t* end) noexcept
+{
+    const auto available = static_cast<std::size_t>(end - type);
+    std::size_t result {0};
+    switch (*type) {
+    case 'A': [[fallthrough]];
+    case 'c': [[fallthrough]];
+    case 'C': result = 2; break;
+    case 's': [[fallthrough]];
+    case 'S': result = 3; break;
+    case 'i': [[fallthrough]];
+    case 'I': [[fallthrough]];
+    case 'f': result = 5; break;
+    case 'd': result = 9; break;
+    case 'Z': [[fallthrough]];
+    case 'H': {
+        const auto nul = static_cast<const std::uint8_t*>(std::memchr(type + 1, '\0', available - 1));
+        return nul ? static_cast<std::size_t>(nul - type) + 1 : 0;
+    }
+    case 'B': {
+        if (available < 6) return 0;
+        const auto element_size = type[1] == 'c' || type[1] == 'C' ? 1
+                                : type[1] == 's' || type[1] == 'S' ? 2
+                                : type[1] == 'i' || type[1] == 'I' || type[1] == 'f' ? 4 : 0;
+        if (element_size == 0) return 0;
+        std::uint32_t num_elements;
+        std::memcpy(&num_elements, type + 2, sizeof(num_elements));
+        result = 6 + static_cast<std::size_t>(element_size) * num_elements;
+        break;
+    }
+    }
+    return result <= available ? result : 0;
+}
+
+// Calls f with the start of each aux field (tag id followed by type).
+template <typename F>
+void for_each_aux(const bam1_t& read, F f)
+{
+    const std::uint8_t* aux = bam_get_aux(&read);
+    const std::uint8_t* const end = read.data + read.l_data;
+    while (end - aux >= 3) {
+        const auto size = aux_size(aux + 2, end);
+        if (size == 0) break;
+        f(aux);
+        aux += 2 + size;
+    }
+}
+
+// Applies all tag edits of a record in one pass over its aux data, with the
+// result of calling bam_aux_update_* for each edit in turn: existing tags are
+// overwritten in place and new tags are appended, so the record is resized at
+// most once. The buffers are reused from one record to the next.
+class AuxEditor
+{
+public:
+    void add(const Tag& tag);
+    void apply(bam1_t* rec);
+private:
+    std::vector<Tag> tags_;
+    std::vector<char> applied_;
+    std::vector<std::uint8_t> aux_;
+    
+    std::pair<std::size_t, char> resolve(std::size_t first, char existing_type) const noexcept;
+    void encode(const Tag& tag, char type);
+};
+
+inline void AuxEditor::add(const Tag& tag)
+{
+    if (const auto value = std::get_if<std::string_view>(&tag.value); value && value->empty()) return;
+    tags_.push_back(tag);
+}
+
+inline bool fits_aux_int(const long value, const char type) noexcept
+{
+    switch (type) {
+    case 'c': return value >= std::numeric_limits<std::int8_t>::min() && value <= std::numeric_limits<std::int8_t>::max();
+    case 'C': return value >= 0 && value <= std::numeric_limits<std::uint8_t>::max();
+    case 's': return value >= std::numeric_limits<std::int16_t>::min() && value <= std::numeric_limits<std::int16_t>::max();
+    case 'S': return value >= 0 && value <= std::numeric_limits<std::uint16_t>::max();
+    case 'i': return value >= std::numeric_limits<std::int32_t>::min() && value <= std::numeric_limits<std::int32_t>::max();
+    case 'I': return value >= 0 && value <= std::numeric_limits<std::uint32_t>::max();
+    default: return false;
+    }
+}
+
+// The type a tag has after a value is written over one of type existing_type
+// ('\0' if absent) by bam_aux_update_*, or '\0' if the update is refused.
+inline char update_aux_type(const Tag::Value& value, const char existing_type) noexcept
+{
+    return std::visit([=] (auto&& value) -> char {
+        using T = std::remove_cv_t<std::decay_t<decltype(value)>>;
+        if constexpr (std::is_same_v<T, long>) {
+            constexpr std::string_view int_types {"cCsSiI"};
+            const auto existing = int_types.find(existing_type);
+            if (existing_type != '\0' && existing == std::string_view::npos) return '\0';
+            // The smallest type that holds the value, unless an existing tag
+            // is wider, which keeps its width but takes the sign of the value
+            const auto types = value < 0 ? std::string_view {"csi"} : std::string_view {"CSI"};
+            const auto smallest = std::find_if(std::cbegin(types), std::cend(types), [&] (char t) { return fits_aux_int(value, t); });
+            if (smallest == std::cend(types)) return '\0'; // out of range for BAM
+            const auto width = static_cast<std::size_t>(smallest - std::cbegin(types));
+            return types[existing != std::string_view::npos ? std::max(width, existing / 2) : width];
+        } else if constexpr (std::is_same_v<T, float>) {
+            return existing_type == '\0' || existing_type == 'f' || existing_type == 'd' ? 'f' : '\0';
+        } else if constexpr (std::is_same_v<T, std::string_view>) {
+            return existing_type == '\0' || existing_type == 'Z' ? 'Z' : '\0';
+        } else { 
+            static_assert(always_false_v<T>, "non-exhaustive visitor!");
+        }
+    }, value);
+}
+
+// Folds the edits of the tag first edited at tags_[first], in the order they
+// were added, to the last one applied and its type ('\0' if none is).
+inline std::pair<std::size_t, char> AuxEditor::resolve(const std::size_t first, char existing_type) const noexcept
+{
+    std::pair<std::size_t, char> result {first, '\0'};
+    for (auto i = first; i < tags_.size(); ++i) {
+        if (tags_[i].id != tags_[first].id) continue;
+        if (const auto type = update_aux_type(tags_[i].value, existing_type); type != '\0') {
+            result = {i, type};
+            existing_type = type;
+        }
+    }
+    return result;
+}
+
+inline void AuxEditor::encode(const Tag& tag, const char type)
+{
+    const auto put = [&] (const auto value) {
+        const auto bytes = reinterpret_cast<const std::uint8_t*>(&value);
+        aux_.insert(std::end(aux_), bytes, bytes + sizeof(value));
+    };
+    aux_.insert(std::end(aux_), {static_cast<std::uint8_t>(tag.id[0]), static_cast<std::uint8_t>(tag.id[1]), static_cast<std::uint8_t>(type)});
+    std::visit([&] (auto&& value) {
+        using T = std::remove_cv_t<std::decay_t<decltype(value)>>;
+        if constexpr (std::is_same_v<T, long>) {
+            switch (type) {
+            case 'c': put(static_cast<std::int8_t>(value)); break;
+            case 'C': put(static_cast<std::uint8_t>(value)); break;
+            case 's': put(static_cast<std::int16_t>(value)); break;
+            case 'S': put(static_cast<std::uint16_t>(value)); break;
+            case 'i': put(static_cast<std::int32_t>(value)); break;
+            default: put(static_cast<std::uint32_t>(value));
+            }
+        } else if constexpr (std::is_same_v<T, float>) {
+            put(value);
+        } else if constexpr (std::is_same_v<T, std::string_view>) {
+            aux_.insert(std::end(aux_), std::cbegin(value), std::cend(value));
+            aux_.push_back('\0');
+        } else { 
+            static_assert(always_false_v<T>, "non-exhaustive visitor!");
+        }
+    }, tag.value);
+}
+
+inline void AuxEditor::apply(bam1_t* rec)
+{
+    if (tags_.empty()) return;
+    // Index of the first edit of a tag
+    const auto find = [&] (const char* id) noexcept {
+        return static_cast<std::size_t>(std::find_if(std::cbegin(tags_), std::cend(tags_), [=] (const Tag& tag) {
+            return tag.id[0] == id[0] && tag.id[1] == id[1];
+        }) - std::cbegin(tags_));
+    };
+    const auto find_aux = [&] (const std::uint8_t* aux) noexcept { return find(reinterpret_cast<const char*>(aux)); };
+    bool replace {false};
+    for_each_aux(*rec, [&] (const std::uint8_t* aux) { replace = replace || find_aux(aux) < tags_.size(); });
+    aux_.clear();
+    applied_.assign(tags_.size(), false);
+    // Without existing copies of the edited tags the new ones are only appended
+    auto keep = static_cast<std::size_t>(rec->l_data);
+    if (replace) {
+        const std::uint8_t* const end = rec->data + rec->l_data;
+        const std::uint8_t* rest {bam_get_aux(rec)};
+        keep = static_cast<std::size_t>(rest - rec->data);
+        for_each_aux(*rec, [&] (const std::uint8_t* aux) {
+            rest = aux + 2 + aux_size(aux + 2, end);
+            const auto i = find_aux(aux);
+            // Only the first copy of a tag is edited, as by bam_aux_update_*
+            if (i < tags_.size() && !applied_[i]) {
+                applied_[i] = true;
+                if (const auto [last, type] = resolve(i, static_cast<char>(aux[2])); type != '\0') {
+                    encode(tags_[last], type);
+                    return;
+                }
+            }
+            aux_.insert(std::end(aux_), aux, rest);
+        });
+        aux_.insert(std::end(aux_), rest, end);
+    }
+    for (std::size_t i {0}; i < tags_.size(); ++i) {
+        if (applied_[i] || find(tags_[i].id.data()) != i) continue;
+        if (const auto [last, type] = resolve(i, '\0'); type != '\0') encode(tags_[last], type);
+    }
+    tags_.clear();
+    const auto size = keep + aux_.size();
+    if (size > static_cast<std::size_t>(std::numeric_limits<int>::max())
+     || (size > rec->m_data && sam_realloc_bam_data(rec, size) < 0)) {
+        throw_error("Failed to add tags to read ", bam_get_qname(rec));
+    }
+    std::copy(std::cbegin(aux_), std::cend(aux_), rec->data + keep);
+    rec->l_data = static_cast<int>(size);
+}
+
+inline std::string_view get_qname(const bam1_t& rec) noexcept
+{
+    // l_qname includes the NUL terminator and any extra NUL padding
+    return {bam_get_qname(&rec), static_cast<std::size_t>(rec.core.l_qname - rec.core.l_extranul - 1)};
+}
+
+// Time spent in each stage of tagging, summed over the threads doing it.
+// Only measured for --profile.
+struct StageTimes
+{
+    using Duration = std::chrono::steady_clock::duration;
+    Duration decode {}, lookup {}, edit {}, stats {}, encode {};
+};
+
+inline StageTimes& operator+=(StageTimes& lhs, const StageTimes& rhs) noexcept
+{
+    lhs.decode += rhs.decode;
+    lhs.lookup += rhs.lookup;
+    lhs.edit += rhs.edit;
+    lhs.stats += rhs.stats;
+    lhs.encode += rhs.encode;
+    return lhs;
+}
+
+// Charges the time since the previous lap to a stage. Disabled clocks never
+// read the time, which is not free when done for every record.
+class StageClock
+{
+public:
+    explicit StageClock(const bool enabled) noexcept
+    : enabled_ {enabled}
+    , last_ {enabled ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point {}}
+    {}
+    void lap(StageTimes::Duration& stage) noexcept
+    {
+        if (!enabled_) return;
+        const auto now = std::chrono::steady_clock::now();
+        stage += now - last_;
+        last_ = now;
+    }
+private:
+    bool enabled_;
+    std::chrono::steady_clock::time_point last_;
+};
+
+struct TagCounts
+{
+    std::size_t reads = 0, marked = 0, filtered = 0;
+    StageTimes times {};
+};
+
+inline TagCounts& operator+=(TagCounts& lhs, const TagCounts& rhs) noexcept
+{
+    lhs.reads += rhs.reads;
+    lhs.marked += rhs.marked;
+    lhs.filtered += rhs.filtered;
+    lhs.times += rhs.times;
+    return lhs;
+}
+
+inline void 
+apply_edits(bam1_t* rec,
+            AuxEditor& editor,
+            const ReadEdits& edits,
+            const std::span<const EditTag> tags,
+            const std::span<const char> strings,
+            const std::optional<Tag>& tag,
+            const std::optional<std::uint16_t> flag)
+{
+    const auto read_flag = static_cast<std::uint16_t>(flag.value_or(0) | edits.flag);
+    rec->core.flag |= read_flag;
+    if (!tag && edits.num_tags == 0 && !flag && edits.flag == 0) {
+        std::clog << "WARN: no tags or flags for read " << get_qname(*rec) << std::endl;
+    }
+    if (tag) {
+        editor.add(*tag);
+    }
+    const auto tags_begin = std::next(std::cbegin(tags), edits.tags_begin);
+    std::for_each(tags_begin, std::next(tags_begin, edits.num_tags), [&] (const EditTag& t) {
+        editor.add(get_tag(t, strings));
+    });
+    editor.apply(rec);
+}
+
+inline const ReadEdits* 
+find_read(const bam1_t& rec,
+          const ReadList& reads,
+          const TargetRegions* targets,
+          TagCounts& counts)
+{
+    ++counts.reads;
+    if (targets && !overlaps(rec, *targets)) return nullptr;
+    const auto name = get_qname(rec);
+    const auto hash = hash_read_name(name);
+    if (reads.filter && !reads.filter->may_contain(hash)) {
+        ++counts.filtered;
+        return nullptr;
+    }
+    return reads.names.find(name, hash);
+}
+
+inline void 
+tag_read(bam1_t* rec,
+         AuxEditor& editor,
+         const ReadList& reads,
+         const std::optional<Tag>& tag,
+         const std::optional<std::uint16_t> flag,
+         const TargetRegions* targets,
+         TagCounts& counts,
+         StageClock& clock)
+{
+    const auto read_edits = find_read(*rec, reads, targets, counts);
+    clock.lap(counts.times.lookup);
+    if (!read_edits) return;
+    ++counts.marked;
+    apply_edits(rec, editor, *read_edits, edit_tags(reads), edit_strings(reads), tag, flag);
+    clock.lap(counts.times.edit);
+}
+
+constexpr std::size_t lookup_group_size {64};
+
+// Tags a batch of reads a group at a time, overlapping the cache misses of
+// their lookups as hash joins do: each step of the lookup (filter block,
+// index slot, entry) is prefetched for every read in the group before
+// any read takes the next step.
+template <typename Record>
+void 
+tag_read_batch(const std::span<Record> batch,
+               AuxEditor& editor,
+               const ReadList& reads,
+               const std::optional<Tag>& tag,
+               const std::optional<std::uint16_t> flag,
+               const TargetRegions* targets,
+               TagCounts& counts,
+               StageClock& clock)
+{
+    std::array<std::uint64_t, lookup_group_size> hashes;
+    std::array<bool, lookup_group_size> candidates;
+    for (std::size_t first {0}; first < batch.size(); first += lookup_group_size) {
+        const auto group = batch.subspan(first, std::min(lookup_group_size, batch.size() - first));
+        for (std::size_t i {0}; i < group.size(); ++i) {
+            candidates[i] = !targets || overlaps(*group[i], *targets);
+            if (!candidates[i]) continue;
+            hashes[i] = hash_read_name(get_qname(*group[i]));
+            if (reads.filter) {
+                reads.filter->prefetch(hashes[i]);
+            } else {
+                reads.names.prefetch_slot(hashes[i]);
+            }
+        }
+        if (reads.filter) {
+            for (std::size_t i {0}; i < group.size(); ++i) {
+                if (!candidates[i]) continue;
+                if (reads.filter->may_contain(hashes[i])) {
+                    reads.names.prefetch_slot(hashes[i]);
+                } else {
+                    candidates[i] = false;
+                    ++counts.filtered;
+                }
+            }
+        }
+        for (std::size_t i {0}; i < group.size(); ++i) {
+            if (candidates[i]) reads.names.prefetch_entry(hashes[i]);
+        }
+        counts.reads += group.size();
+        for (std::size_t i {0}; i < group.size(); ++i) {
+            const auto read_edits = candidates[i] ? reads.names.find(get_qname(*group[i]), hashes[i]) : nullptr;
+            clock.lap(counts.times.lookup);
+            if (!read_edits) continue;
+            ++counts.marked;
+            apply_edits(&*group[i], editor, *read_edits, edit_tags(reads), edit_strings(reads), tag, flag);
+            clock.lap(counts.times.edit);
+        }
+    }
+}
+
+//
+// stats
+//
+
+// Tag value pattern (ECMAScript regex with search semantics). Patterns made of
+// literals, optionally anchored or alternated, are matched without std::regex.
+class TagPattern
+{
+public:
+    explicit TagPattern(std::string_view pattern);
+    
+    bool matches(std::string_view value) const;
+
+private:
+    struct Literal
+    {
+        std::string text;
+        bool anchor_begin = false, anchor_end = false;
+    };
+    
+    std::vector<Literal> literals_;
+    std::optional<std::regex> regex_;
+    
+    static std::optional<Literal> parse_literal(std::string_view pattern);
+    static std::optional<std::vector<std::string_view>> split_alternatives(std::string_view pattern);
+};
+
+inline TagPattern::TagPattern(const std::string_view pattern)
+{
+    auto alternatives = split_alternatives(pattern);
+    bool anchor_begin {false}, anchor_end {false};
+    if (!alternatives) {
+        // ^(a|b|c)$ with the anchors applying to every alternative
+        auto group = pattern;
+        anchor_begin = group.starts_with('^');
+        if (anchor_begin) group.remove_prefix(1);
+        anchor_end = group.ends_with('$') && !group.ends_with("\\$");
+        if (anchor_end) group.remove_suffix(1);
+        if (group.size() > 2 && group.front() == '(' && group.back() == ')' && group[1] != '?') {
+            alternatives = split_alternatives(group.substr(1, group.size() - 2));
+        }
+    }
+    if (alternatives) {
+        for (const auto& alternative : *alternatives) {
+            auto literal = parse_literal(alternative);
+            if (!literal) {
+                literals_.clear();
+                break;
+            }
+            literal->anchor_begin |= anchor_begin;
+            literal->anchor_end |= anchor_end;
+            literals_.push_back(std::move(*literal));
+        }
+    }
+    if (literals_.empty()) {
+        regex_ = std::regex {std::string {pattern}};
+    }
+}
+
+inline bool TagPattern::matches(const std::string_view value) const
+{
+    if (regex_) return std::regex_search(std::cbegin(value), std::cend(value), *regex_);
+    return std::any_of(std::cbegin(literals_), std::cend(literals_), [value] (const Literal& literal) {
+        if (literal.anchor_begin && literal.anchor_end) return value == literal.text;
+        if (literal.anchor_begin) return value.starts_with(literal.text);
+        if (literal.anchor_end) return value.ends_with(literal.text);
+        return value.find(literal.text) != std::string_view::npos;
+    });
+}
+
+inline std::optional<TagPattern::Literal> TagPattern::parse_literal(std::string_view pattern)
+{
+    constexpr std::string_view metacharacters {".[]{}()*+?|^$"};
+    Literal result {};
+    if (pattern.starts_with('^')) {
+        result.anchor_begin = true;
+        pattern.remove_prefix(1);
+    }
+    for (std::size_t i {0}; i < pattern.size(); ++i) {
+        const auto c = pattern[i];
+        if (c == '\\') {
+            // Escaped punctuation is literal; \d, \b etc. are not
+            if (i + 1 == pattern.size() || std::isalnum(static_cast<unsigned char>(pattern[i + 1]))) return std::nullopt;
+            result.text += pattern[++i];
+        } else if (c == '$' && i + 1 == pattern.size()) {
+            result.anchor_end = true;
+        } else if (metacharacters.find(c) != std::string_view::npos) {
+            return std::nullopt;
+        } else {
+            result.text += c;
+        }
+    }
+    return result;
+}
+
+inline std::optional<std::vector<std::string_view>> TagPattern::split_alternatives(const std::string_view pattern)
+{
+    std::vector<std::string_view> result {};
+    std::size_t begin {0};
+    for (std::size_t i {0}; i < pattern.size(); ++i) {
+        switch (pattern[i]) {
+        case '\\': ++i; break;
+        case '(': [[fallthrough]];
+        case ')': [[fallthrough]];
+        case '[': [[fallthrough]];
+        case ']': return std::nullopt;
+        case '|':
+            result.push_back(pattern.substr(begin, i - begin));
+            begin = i + 1;
+            break;
+        }
+    }
+    result.push_back(pattern.substr(begin));
+    return result;
+}
+
+struct SearchTag
+{
+    Tag::Name id;
+    std::optional<std::string> value;
+    std::optional<TagPattern> pattern;
+};
+
+inline bool operator==(const SearchTag& lhs, const SearchTag& rhs) noexcept
+{
+    return lhs.id == rhs.id && lhs.value == rhs.value;
+}
+
+// Space-Saving summary of the most frequent values. Counts are upper bounds,
+// exact for values seen before the summary first filled.
+class HeavyHitters
+{
+public:
+    explicit HeavyHitters(std::size_t k);
+    HeavyHitters(const HeavyHitters& other);
+    HeavyHitters& operator=(const HeavyHitters&) = delete;
+    HeavyHitters(HeavyHitters&&) = default;
+    HeavyHitters& operator=(HeavyHitters&&) = default;
+    
+    void add(std::string_view value);
+    HeavyHitters& operator+=(const HeavyHitters& other);
+    std::vector<std::pair<std::string, std::size_t>> top() const;
+
+private:
+    using PositionMap = std::unordered_map<std::string, std::size_t, StringHash, std::equal_to<>>;
+    struct Counter
+    {
+        std::size_t count;
+        PositionMap::value_type* value;
+    };
+    
+    std::size_t k_, capacity_;
+    PositionMap positions_;
+    std::vector<Counter> heap_; // min-heap on count
+    
+    void assign(std::vector<std::pair<std::string, std::size_t>> counts);
+    void place(std::size_t position, Counter counter) noexcept;
+    void sift_up(std::size_t position) noexcept;
+    void sift_down(std::size_t position) noexcept;
+};
+
+inline HeavyHitters::HeavyHitters(const std::size_t k)
+: k_ {k}
+, capacity_ {std::max(4 * k, std::size_t {1})}
+{
+    positions_.reserve(capacity_);
+    heap_.reserve(capacity_);
+}
+
+inline HeavyHitters::HeavyHitters(const HeavyHitters& other)
+: HeavyHitters {other.k_}
+{
+    std::vector<std::pair<std::string, std::size_t>> counts {};
+    for (const auto& counter : other.heap_) counts.emplace_back(counter.value->first, counter.count);
+    assign(std::move(counts));
+}
+
+inline void HeavyHitters::add(const std::string_view value)
+{
+    if (const auto itr = positions_.find(value); itr != std::end(positions_)) {
+        ++heap_[itr->second].count;
+        sift_down(itr->second);
+    } else if (heap_.size() < capacity_) {
+        const auto position = heap_.size();
+        heap_.push_back({1, &*positions_.emplace(value, position).first});
+        sift_up(position);
+    } else {
+        // Replace the least frequent value, inheriting its count
+        auto& min = heap_.front();
+        positions_.erase(min.value->first);
+        min.value = &*positions_.emplace(value, 0).first;
+        ++min.count;
+        sift_down(0);
+    }
+}
+
+inline HeavyHitters& HeavyHitters::operator+=(const HeavyHitters& other)
+{
+    std::unordered_map<std::string, std::size_t, StringHash, std::equal_to<>> merged {};
+    for (const auto* summary : {static_cast<const HeavyHitters*>(this), &other}) {
+        for (const auto& counter : summary->heap_) {
+            merged[counter.value->first] += counter.count;
+        }
+    }
+    assign({std::make_move_iterator(std::begin(merged)), std::make_move_iterator(std::end(merged))});
+    return *this;
+}
+
+inline std::vector<std::pair<std::string, std::size_t>> HeavyHitters::top() const
+{
+    std::vector<std::pair<std::string, std::size_t>> result {};
+    result.reserve(heap_.size());
+    for (const auto& counter : heap_) result.emplace_back(counter.value->first, counter.count);
+    const auto k = std::min(k_, result.size());
+    std::partial_sort(std::begin(result), std::next(std::begin(result), k), std::end(result),
+        [] (const auto& lhs, const auto& rhs) { return lhs.second > rhs.second; });
+    result.resize(k);
+    return result;
+}
+
+inline void HeavyHitters::assign(std::vector<std::pair<std::string, std::size_t>> counts)
+{
+    if (counts.size() > capacity_) {
+        std::nth_element(std::begin(counts), std::next(std::begin(counts), capacity_), std::end(counts),
+            [] (const auto& lhs, const auto& rhs) { return lhs.second > rhs.second; });
+        counts.resize(capacity_);
+    }
+    positions_.clear();
+    heap_.clear();
+    for (auto& [value, count] : counts) {
+        const auto position = heap_.size();
+        heap_.push_back({count, &*positions_.emplace(std::move(value), position).first});
+        sift_up(position);
+    }
+}
+
+inline void HeavyHitters::place(const std::size_t position, const Counter counter) noexcept
+{
+    heap_[position] = counter;
+    counter.value->second = position;
+}
+
+inline void HeavyHitters::sift_up(std::size_t position) noexcept
+{
+    const auto counter = heap_[position];
+    while (position > 0) {
+        const auto parent = (position - 1) / 2;
+        if (heap_[parent].count <= counter.count) break;
+        place(position, heap_[parent]);
+        position = parent;
+    }
+    place(position, counter);
+}
+
+inline void HeavyHitters::sift_down(std::size_t position) noexcept
+{
+    const auto counter = heap_[position];
+    for (auto child = 2 * position + 1; child < heap_.size(); child = 2 * position + 1) {
+        if (child + 1 < heap_.size() && heap_[child + 1].count < heap_[child].count) ++child;
+        if (counter.count <= heap_[child].count) break;
+        place(position, heap_[child]);
+        position = child;
+    }
+    place(position, counter);
+}
+
+// HyperLogLog estimate of the number of distinct values.
+class DistinctCounter
+{
+public:
+    DistinctCounter() : registers_(num_registers) {}
+    
+    void add(const std::string_view value) noexcept
+    {
+        const auto hash = hash_read_name(value);
+        const auto rank = static_cast<std::uint8_t>(std::countl_zero((hash << precision) | (1ull << (precision - 1))) + 1);
+        auto& reg = registers_[hash >> (64 - precision)];
+        reg = std::max(reg, rank);
+    }
+    
+    DistinctCounter& operator+=(const DistinctCounter& other) noexcept
+    {
+        std::transform(std::cbegin(registers_), std::cend(registers_), std::cbegin(other.registers_), std::begin(registers_),
+            [] (auto lhs, auto rhs) { return std::max(lhs, rhs); });
+        return *this;
+    }
+    
+    std::size_t estimate() const noexcept
+    {
+        constexpr double m {num_registers};
+        const auto alpha = 0.7213 / (1 + 1.079 / m);
+        double sum {0};
+        std::size_t zeros {0};
+        for (const auto reg : registers_) {
+            sum += std::ldexp(1.0, -reg);
+            zeros += reg == 0;
+        }
+        auto result = alpha * m * m / sum;
+        if (result <= 2.5 * m && zeros > 0) {
+            result = m * std::log(m / zeros);
+        }
+        return static_cast<std::size_t>(std::llround(result));
+    }
+
+private:
+    constexpr static int precision {14};
+    constexpr static std::size_t num_registers {1 << precision};
+    
+    std::vector<std::uint8_t> registers_;
+};
+
+// Split counts for one tag id. Exact string values are copied only on first 
+// insert, and exact numeric values are formatted when written. With --top or
+// --distinct values are formatted into a buffer and fed to bounded sketches.
+struct ValueCounts
+{
+    bool exact = true;
+    std::unordered_map<std::string, std::size_t, StringHash, std::equal_to<>> strings;
+    std::unordered_map<std::int64_t, std::size_t> integers;
+    std::unordered_map<std::uint64_t, std::size_t> floats; // by bit pattern
+    std::optional<HeavyHitters> top;
+    std::optional<DistinctCounter> distinct;
+};
+
+inline void add_sketch_value(const std::string_view value, ValueCounts& counts)
+{
+    if (counts.top) counts.top->add(value);
+    if (counts.distinct) counts.distinct->add(value);
+}
+
+inline void add_value(const std::string_view value, ValueCounts& counts)
+{
+    if (counts.exact) {
+        if (const auto itr = counts.strings.find(value); itr != std::end(counts.strings)) {
+            ++itr->second;
+        } else {
+            counts.strings.emplace(value, 1);
+        }
+    }
+    add_sketch_value(value, counts);
+}
+
+inline void add_value(const std::int64_t value, ValueCounts& counts)
+{
+    if (counts.exact) ++counts.integers[value];
+    if (counts.top || counts.distinct) {
+        std::array<char, 24> buffer;
+        const auto [end, ec] = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value);
+        add_sketch_value({buffer.data(), end}, counts);
+    }
+}
+
+inline void add_value(const double value, ValueCounts& counts)
+{
+    if (counts.exact) ++counts.floats[std::bit_cast<std::uint64_t>(value)];
+    if (counts.top || counts.distinct) {
+        // Same as std::to_string
+        std::array<char, 512> buffer;
+        const auto [end, ec] = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value, std::chars_format::fixed, 6);
+        add_sketch_value({buffer.data(), ec == std::errc {} ? end : buffer.data()}, counts);
+    }
+}
+
+template <typename Map>
+void merge(Map& lhs, const Map& rhs)
+{
+    for (const auto& [value, count] : rhs) {
+        lhs[value] += count;
+    }
+}
+
+inline ValueCounts& operator+=(ValueCounts& lhs, const ValueCounts& rhs)
+{
+    merge(lhs.strings, rhs.strings);
+    merge(lhs.integers, rhs.integers);
+    merge(lhs.floats, rhs.floats);
+    if (lhs.top && rhs.top) *lhs.top += *rhs.top;
+    if (lhs.distinct && rhs.distinct) *lhs.distinct += *rhs.distinct;
+    return lhs;
+}
+
+struct TagStats
+{
+    // Grouped by tag id, with tag_index mapping each id to one plus the
+    // position of its first count (0 if the id is not searched). Value 
+    // counts are stored at the position of the first count for each id.
+    std::vector<std::pair<SearchTag, std::size_t>> counts;
+    std::vector<std::uint16_t> tag_index;
+    std::optional<std::vector<ValueCounts>> value_counts;
+    std::size_t total_reads;
+    // One plus the number of the read in which each id was last counted, so
+    // that a read with several copies of a tag is counted once
+    std::vector<std::size_t> counted;
+};
+
+inline auto get_tag_index(const std::uint8_t* id) noexcept
+{
+    return static_cast<std::size_t>(id[0]) << 8 | id[1];
+}
+
+inline TagStats& operator+=(TagStats& lhs, const TagStats& rhs)
+{
+    assert(lhs.counts.size() == rhs.counts.size());
+    for (std::size_t i {0}; i < rhs.counts.size(); ++i) {
+        lhs.counts[i].second += rhs.counts[i].second;
+    }
+    if (rhs.value_counts) {
+        assert(lhs.value_counts && lhs.value_counts->size() == rhs.value_counts->size());
+        for (std::size_t i {0}; i < rhs.value_counts->size(); ++i) {
+            (*lhs.value_counts)[i] += (*rhs.value_counts)[i];
+        }
+    }
+    lhs.total_reads += rhs.total_reads;
+    return lhs;
+}
+
+inline void add_read(const bam1_t& read, TagStats& stats)
+{
+    for_each_aux(read, [&] (const std::uint8_t* aux) {
+        const auto first = stats.tag_index[get_tag_index(aux)];
+        if (first == 0 || stats.counted[first - 1] == stats.total_reads + 1) return;
+        stats.counted[first - 1] = stats.total_reads + 1;
+        const auto p = aux + 2;
+        const Tag::Name id {static_cast<char>(aux[0]), static_cast<char>(aux[1])};
+        const auto value_counts = stats.value_counts ? &(*stats.value_counts)[first - 1] : nullptr;
+        for (auto itr = std::next(std::begin(stats.counts), first - 1); itr != std::end(stats.counts) && itr->first.id == id; ++itr) {
+            auto& [tag, count] = *itr;
+            if (tag.pattern) {
+                const auto value = bam_aux2Z(p);
+                // TODO - what if type is not string?
+                if (value && tag.pattern->matches(value)) {
+                    ++count;
+                    if (value_counts) add_value(value, *value_counts);
+                }
+            } else {
+                ++count;
+                if (value_counts) {
+                    const auto type = static_cast<char>(*p);
+                    switch (type) {
+                    case 'c': [[fallthrough]];
+                    case 'C': [[fallthrough]];
+                    case 's': [[fallthrough]];
+                    case 'S': [[fallthrough]];
+                    case 'i': [[fallthrough]];
+                    case 'I': add_value(bam_aux2i(p), *value_counts); break;
+                    case 'f': add_value(bam_aux2f(p), *value_counts); break;
+                    case 'Z': add_value(bam_aux2Z(p), *value_counts); break;
+                    }
+                }
+            }
+        }
+    });
+    ++stats.total_reads;
+}
+
+template <typename Range>
+void write(const Range& values, std::ostream& os, const char delimiter='\t')
+{
+    using T = typename std::iterator_traits<typename Range::const_iterator>::value_type;
+    std::copy(std::cbegin(values), std::prev(std::cend(values)), std::ostream_iterator<T> {os});
+    os << values.back();
+}
+
+// Numeric values are formatted as by std::to_string, so values printing 
+// the same are counted together.
+inline auto get_value_counts(const TagStats& stats)
+{
+    std::vector<std::pair<SearchTag, std::size_t>> result {};
+    if (!stats.value_counts) return result;
+    for (std::size_t i {0}; i < stats.counts.size(); ++i) {
+        if (i > 0 && stats.counts[i - 1].first.id == stats.counts[i].first.id) continue;
+        const auto& counts = (*stats.value_counts)[i];
+        const auto& id = stats.counts[i].first.id;
+        if (counts.top) {
+            for (auto& [value, count] : counts.top->top()) {
+                result.emplace_back(SearchTag {id, std::move(value), std::nullopt}, count);
+            }
+        }
+        if (counts.distinct) {
+            result.emplace_back(SearchTag {id, "#distinct", std::nullopt}, counts.distinct->estimate());
+        }
+        if (!counts.exact) continue;
+        std::unordered_map<std::string, std::size_t, StringHash, std::equal_to<>> formatted {counts.strings};
+        for (const auto& [value, count] : counts.integers) {
+            formatted[std::to_string(value)] += count;
+        }
+        for (const auto& [value, count] : counts.floats) {
+            formatted[std::to_string(std::bit_cast<double>(value))] += count;
+        }
+        for (auto& [value, count] : formatted) {
+            result.emplace_back(SearchTag {id, value, std::nullopt}, count);
+        }
+    }
+    return result;
+}
+
+inline void write(const TagStats& stats, std::ostream& os, const bool sorted = false, const char delimiter='\t')
+{
+    os << "tag" << delimiter << "value" << delimiter << "count" << delimiter << "fraction" << '\n';
+    os << '*' << delimiter << '*' << delimiter << stats.total_reads << delimiter << '1' << '\n';
+    const auto write_row = [&] (const auto& tag, const auto count) {
+        std::copy(std::cbegin(tag.id), std::cend(tag.id), std::ostreambuf_iterator<char> {os});
+        os << delimiter;
+        if (tag.value) {
+            os << *tag.value;
+        } else {
+            os << '*';
+        }
+        os << delimiter;
+        os << count << delimiter;
+        if (stats.total_reads > 0) {
+            os << static_cast<float>(count) / stats.total_reads;
+        } else {
+            os << '0';
+        }
+        os << std::endl;
+    };
+    const auto value_counts = get_value_counts(stats);
+    if (sorted) {
+        std::vector<std::pair<SearchTag, std::size_t>> counts {
+            std::begin(stats.counts), std::end(stats.counts)
+        };
+        counts.insert(std::end(counts), std::begin(value_counts), std::end(value_counts));
+        const static auto count_greater = [] (const auto& lhs, const auto& rhs) noexcept {
+            return lhs.second > rhs.second;
+        };
+        std::sort(std::begin(counts), std::end(counts), count_greater);
+        for (const auto& [tag, count] : counts) {
+            write_row(tag, count);
+        }
+    } else {
+        for (const auto& [tag, count] : stats.counts) {
+            write_row(tag, count);
+        }
+        for (const auto& [tag, count] : value_counts) {
+            write_row(tag, count);
+        }
+    }
+}
+
+inline auto parse_search_tag(const std::string_view tag)
+{
+    if (tag.size() < 2 || tag.size() == 3 || (tag.size() > 3 && tag[2] != ':')) {
+        throw_error("Invalid tag ", tag, " (required TAG[:VALUE])");
+    }
+    SearchTag result {};
+    std::copy_n(std::cbegin(tag), 2, std::begin(result.id));
+    if (tag.size() > 3) {
+        result.value = tag.substr(3);
+        try {
+            result.pattern.emplace(*result.value);
+        } catch (const std::regex_error& error) {
+            throw_error("Invalid pattern ", *result.value, " for tag ", tag.substr(0, 2), ": ", error.what());
+        }
+    }
+    return result;
+}
+
+inline TagStats init_stats(const std::vector<SearchTag>& tags, 
+                    const bool split = false, 
+                    const std::optional<std::size_t>& top = std::nullopt, 
+                    const bool distinct = false)
+{
+    TagStats result {};
+    result.counts.reserve(tags.size());
+    for (const auto& tag : tags) {
+        const auto duplicate = std::find_if(std::cbegin(result.counts), std::cend(result.counts), 
+            [&] (const auto& count) { return count.first == tag; });
+        if (duplicate == std::cend(result.counts)) {
+            result.counts.emplace_back(tag, 0);
+        }
+    }
+    std::stable_sort(std::begin(result.counts), std::end(result.counts), 
+        [] (const auto& lhs, const auto& rhs) { return lhs.first.id < rhs.first.id; });
+    result.tag_index.resize(1 << 16);
+    result.counted.resize(result.counts.size());
+    for (std::size_t i {result.counts.size()}; i > 0; --i) {
+        const auto& id = result.counts[i - 1].first.id;
+        result.tag_index[get_tag_index(reinterpret_cast<const std::uint8_t*>(id.data()))] = static_cast<std::uint16_t>(i);
+    }
+    if (split || top || distinct) {
+        result.value_counts.emplace(result.counts.size());
+        for (std::size_t i {0}; i < result.counts.size(); ++i) {
+            if (i > 0 && result.counts[i - 1].first.id == result.counts[i].first.id) continue;
+            auto& counts = (*result.value_counts)[i];
+            counts.exact = split && !top;
+            if (top) counts.top.emplace(*top);
+            if (distinct) counts.distinct.emplace();
+        }
+    }
+    return result;
+}
+
+} // namespace samtag::detail
+
+#endif // SAMTAG_ENGINE_HPP
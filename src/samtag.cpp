@@ -0,0 +1,167 @@
+// Copyright (c) 2022 Daniel Cooke
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#include "samtag.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <ostream>
+
+#include "engine.hpp"
+
+namespace samtag {
+
+struct ReadNameIndex::Impl
+{
+    detail::ReadList reads;
+};
+
+ReadNameIndex::ReadNameIndex(const detail::fs::path& path)
+: ReadNameIndex {path, Options {}}
+{}
+
+ReadNameIndex::ReadNameIndex(const detail::fs::path& path, const Options& options)
+{
+    std::optional<detail::Tag::Name> value_tag {};
+    if (options.value_tag) {
+        if (options.value_tag->size() != 2) detail::throw_error("Invalid value tag ", *options.value_tag, " (required TAG)");
+        value_tag = detail::Tag::Name {(*options.value_tag)[0], (*options.value_tag)[1]};
+    }
+    if (detail::is_read_index(path)) {
+        impl_ = std::make_unique<Impl>(detail::open_read_index(path, value_tag, options.prefilter));
+    } else {
+        detail::WorkerPool workers {options.threads > 1 ? options.threads : 0};
+        impl_ = std::make_unique<Impl>(detail::load_reads(path, value_tag, options.prefilter, &workers));
+    }
+}
+
+ReadNameIndex::ReadNameIndex(ReadNameIndex&&) noexcept = default;
+ReadNameIndex& ReadNameIndex::operator=(ReadNameIndex&&) noexcept = default;
+ReadNameIndex::~ReadNameIndex() = default;
+
+std::size_t ReadNameIndex::size() const noexcept
+{
+    return impl_->reads.names.size();
+}
+
+std::size_t ReadNameIndex::memory_usage() const noexcept
+{
+    return detail::memory_usage(impl_->reads);
+}
+
+bool ReadNameIndex::contains(const std::string_view name) const noexcept
+{
+    return impl_->reads.names.find(name, detail::hash_read_name(name)) != nullptr;
+}
+
+struct Tagger::Impl
+{
+    Impl(const detail::ReadList& reads, const Options& options)
+    : reads {reads}
+    , tag_text {options.tag.value_or("")}
+    , flag {options.flag != 0 ? std::optional {options.flag} : std::nullopt}
+    {
+        if (options.tag) tag = detail::get_tag(tag_text);
+    }
+
+    const detail::ReadList& reads;
+    std::string tag_text; // backs the value of tag
+    std::optional<detail::Tag> tag {};
+    std::optional<std::uint16_t> flag;
+    detail::AuxEditor editor {};
+    TagCounts counts {};
+};
+
+Tagger::Tagger(const ReadNameIndex& reads)
+: Tagger {reads, Options {}}
+{}
+
+Tagger::Tagger(const ReadNameIndex& reads, const Options& options)
+: impl_ {std::make_unique<Impl>(reads.impl_->reads, options)}
+{}
+
+Tagger::Tagger(Tagger&&) noexcept = default;
+Tagger& Tagger::operator=(Tagger&&) noexcept = default;
+Tagger::~Tagger() = default;
+
+std::size_t Tagger::tag(const std::span<bam1_t* const> records)
+{
+    detail::TagCounts counts {};
+    detail::StageClock clock {false};
+    detail::tag_read_batch(records, impl_->editor, impl_->reads, impl_->tag, impl_->flag, nullptr, counts, clock);
+    impl_->counts.reads += counts.reads;
+    impl_->counts.tagged += counts.marked;
+    impl_->counts.filtered += counts.filtered;
+    return counts.marked;
+}
+
+bool Tagger::tag(bam1_t* record)
+{
+    return tag(std::span {&record, 1}) > 0;
+}
+
+const TagCounts& Tagger::counts() const noexcept
+{
+    return impl_->counts;
+}
+
+struct TagStats::Impl
+{
+    Options options;
+    detail::TagStats stats;
+};
+
+TagStats::TagStats(const Options& options)
+{
+    std::vector<detail::SearchTag> tags {};
+    std::transform(std::cbegin(options.tags), std::cend(options.tags), std::back_inserter(tags), 
+                   [] (const auto& tag) { return detail::parse_search_tag(tag); });
+    impl_ = std::make_unique<Impl>(options, detail::init_stats(tags, options.split, options.top, options.distinct));
+}
+
+TagStats::TagStats(const TagStats& other)
+: impl_ {std::make_unique<Impl>(*other.impl_)}
+{}
+
+TagStats& TagStats::operator=(const TagStats& other)
+{
+    if (this != &other) impl_ = std::make_unique<Impl>(*other.impl_);
+    return *this;
+}
+
+TagStats::TagStats(TagStats&&) noexcept = default;
+TagStats& TagStats::operator=(TagStats&&) noexcept = default;
+TagStats::~TagStats() = default;
+
+void TagStats::add(const bam1_t& record)
+{
+    detail::add_read(record, impl_->stats);
+}
+
+void TagStats::add(const std::span<const bam1_t* const> records)
+{
+    for (const auto record : records) detail::add_read(*record, impl_->stats);
+}
+
+TagStats& TagStats::operator+=(const TagStats& other)
+{
+    const auto& lhs = impl_->options;
+    const auto& rhs = other.impl_->options;
+    if (lhs.tags != rhs.tags || lhs.split != rhs.split || lhs.top != rhs.top || lhs.distinct != rhs.distinct) {
+        detail::throw_error("Cannot merge stats made with different options");
+    }
+    impl_->stats += other.impl_->stats;
+    return *this;
+}
+
+std::size_t TagStats::total_reads() const noexcept
+{
+    return impl_->stats.total_reads;
+}
+
+void TagStats::write(std::ostream& os, const bool sorted) const
+{
+    detail::write(impl_->stats, os, sorted);
+}
+
+} // namespace samtag
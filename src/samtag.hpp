@@ -0,0 +1,130 @@
+// Copyright (c) 2022 Daniel Cooke
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+// libsamtag: the tagging engine of samtag for use in-process, on records
+// the caller decodes and encodes itself. A ReadNameIndex is loaded once and
+// may be shared by any number of threads, each with its own Tagger and
+// TagStats; stats from several threads are combined with +=. Errors are
+// thrown as samtag::Error.
+
+#ifndef SAMTAG_HPP
+#define SAMTAG_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <htslib/sam.h>
+
+namespace samtag {
+
+class Error : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Read names with their edits, from a qname TSV or a file written by
+// samtag index-reads (which is mapped rather than read).
+class ReadNameIndex
+{
+public:
+    struct Options
+    {
+        std::optional<std::string> value_tag {}; // the first column holds values of this tag, as for tag --tag ID
+        bool prefilter = false; // reject most unlisted reads with a Bloom filter
+        unsigned threads = 1; // for parsing a qname TSV
+    };
+
+    explicit ReadNameIndex(const std::filesystem::path& path);
+    ReadNameIndex(const std::filesystem::path& path, const Options& options);
+    ReadNameIndex(ReadNameIndex&&) noexcept;
+    ReadNameIndex& operator=(ReadNameIndex&&) noexcept;
+    ~ReadNameIndex();
+
+    std::size_t size() const noexcept;
+    std::size_t memory_usage() const noexcept;
+    bool contains(std::string_view name) const noexcept;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+
+    friend class Tagger;
+};
+
+struct TagCounts
+{
+    std::size_t reads = 0, tagged = 0, filtered = 0;
+};
+
+// Applies the edits of listed reads to records. Not thread safe: the edit
+// buffers are reused from one record to the next.
+class Tagger
+{
+public:
+    struct Options
+    {
+        std::optional<std::string> tag {}; // TAG:VALUE added to every listed read
+        std::uint16_t flag = 0; // added to every listed read
+    };
+
+    // reads must outlive the Tagger
+    explicit Tagger(const ReadNameIndex& reads);
+    Tagger(const ReadNameIndex& reads, const Options& options);
+    Tagger(Tagger&&) noexcept;
+    Tagger& operator=(Tagger&&) noexcept;
+    ~Tagger();
+
+    // Returns the number of records tagged
+    std::size_t tag(std::span<bam1_t* const> records);
+    bool tag(bam1_t* record);
+    const TagCounts& counts() const noexcept;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// Counts of reads with each searched tag, as written by samtag stats.
+class TagStats
+{
+public:
+    struct Options
+    {
+        std::vector<std::string> tags {}; // TAG[:PATTERN], as for stats --tag
+        bool split = false;
+        std::optional<std::size_t> top {};
+        bool distinct = false;
+    };
+
+    explicit TagStats(const Options& options);
+    TagStats(const TagStats& other);
+    TagStats& operator=(const TagStats& other);
+    TagStats(TagStats&&) noexcept;
+    TagStats& operator=(TagStats&&) noexcept;
+    ~TagStats();
+
+    void add(const bam1_t& record);
+    void add(std::span<const bam1_t* const> records);
+    // other must have been made with the same options
+    TagStats& operator+=(const TagStats& other);
+    std::size_t total_reads() const noexcept;
+    void write(std::ostream& os, bool sorted = false) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+} // namespace samtag
+
+#endif // SAMTAG_HPP